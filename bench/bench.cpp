@@ -0,0 +1,250 @@
+// benchmark suite for the CPU core and the CPU side of the renderer
+// runs each ROM headless for a fixed instruction count on the interpreter (and
+// the recompiler where the host supports it) and reports ns/instruction,
+// instructions/s and frames/s, and fails if the two engines end in different
+// states, then times the software upscaler on each of
+// its kernels and the audio renderer at a few callback buffer sizes
+// usage: chip8_bench [-n instructions] [-o results.csv]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "audio.h"
+#include "headless.h"
+#include "jit.h"
+#include "render.h"
+#include "scaler.h"
+
+// one benchmark: a ROM plus optional recorded input
+struct bench_case
+{
+    const char *name;
+    const char *rom;
+    const char *input;
+};
+
+// synthetic ROMs stress one opcode family each; the games run on recorded input
+const bench_case CASES[] = {
+    {"alu", "bench/roms/alu.ch8", NULL},       // op8 register arithmetic/logic
+    {"sprite", "bench/roms/sprite.ch8", NULL}, // op13 sprite draws
+    {"hires", "bench/roms/hires.ch8", NULL},   // SUPER-CHIP 16x16 draws and scrolls at 128x64
+    {"mem", "bench/roms/mem.ch8", NULL},       // op15 BCD, load/store, I arithmetic
+    {"call", "bench/roms/call.ch8", NULL},     // op2 calls and op0 returns
+    {"idle", "bench/roms/idle.ch8", NULL},     // delay timer polling loop (skipped ahead)
+    {"tetris", "roms/tetris.ch8", "bench/tetris.in"},
+    {"keypad", "roms/keypad.ch8", "bench/keypad.in"},
+};
+
+// draw calls in the current run
+unsigned long draw_count = 0;
+
+// backend that counts draws and publishes them like the windowed build does
+bool bench_screen_init(int &xval)
+{
+    triple_init(RENDER_FRAMES);
+    return true;
+}
+
+void bench_screen_close()
+{
+}
+
+int bench_clear_screen()
+{
+    draw_count = draw_count + 1;
+    return RENDER_IO.clear_screen();
+}
+
+int bench_draw_screen(const display_buffer &screen, uint64_t dirty_rows)
+{
+    draw_count = draw_count + 1;
+    return RENDER_IO.draw_screen(screen, dirty_rows);
+}
+
+const io_backend BENCH_IO = {bench_screen_init, bench_screen_close, bench_clear_screen, bench_draw_screen};
+
+int main(int argc, char* argv[])
+{
+    unsigned long cycles = 20000000;
+    // timers tick at the default -s clock (10000 instructions/s)
+    unsigned long tick_cycles = 10000 / 60;
+    const char *out = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "n:o:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            cycles = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            printf("usage: %s [-n instructions] [-o results.csv]\n", argv[0]);
+            return 1;
+        }
+    }
+    FILE *csv = NULL;
+    if (out != NULL)
+    {
+        csv = fopen(out, "w");
+        if (csv == NULL)
+        {
+            printf("ERROR: could not open %s\n", out);
+            return 1;
+        }
+        fprintf(csv, "name,engine,instructions,seconds,ns_per_inst,inst_per_s,frames_per_s,draws_per_s,idle_skipped\n");
+    }
+    Chip8Machine *m = new Chip8Machine();
+    int xval = 0;
+    printf("%-8s %-6s %14s %12s %16s %14s %14s %8s\n", "name", "engine", "instructions", "ns/inst", "inst/s", "frames/s",
+        "draws/s", "idle%");
+    for (unsigned int i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++)
+    {
+        // state the interpreter finished in, which the recompiler has to match
+        unsigned long interp_sum = 0;
+        for (int engine = 0; engine < 2; engine++)
+        {
+            input_script events = {};
+            if (CASES[i].input != NULL && load_input_script(events, CASES[i].input) != 0)
+            {
+                return 1;
+            }
+            if (init_CPU(*m, xval, (char*)CASES[i].rom, &BENCH_IO) != 0)
+            {
+                return 1;
+            }
+            if (engine == 1 && jit_init(*m) != 0)
+            {
+                // no recompiler on this host
+                break;
+            }
+            draw_count = 0;
+            // same fixed random sequence every run
+            CPU_seed(*m, 1);
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int status = run_machine_headless(*m, events, cycles, tick_cycles, NULL, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            jit_close(*m);
+            double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            if (status != 0 || secs <= 0)
+            {
+                printf("ERROR: %s stopped after %lu instructions\n", CASES[i].name, m->cycles);
+                return 1;
+            }
+            const char *name = engine == 0 ? "interp" : "jit";
+            unsigned long sum = headless_checksum(*m);
+            if (engine == 0)
+            {
+                interp_sum = sum;
+            }
+            else if (sum != interp_sum)
+            {
+                printf("ERROR: %s finished in state %016lx on the recompiler, %016lx on the interpreter\n",
+                    CASES[i].name, sum, interp_sum);
+                return 1;
+            }
+            // frames = emulated 60Hz frames
+            double frames = (double)m->cycles / tick_cycles;
+            // ns/inst is per instruction actually run - passes skipped in polling loops
+            // (see CPU_idle_check) cost next to nothing and are only counted in idle%
+            unsigned long ran = m->cycles - m->idle_skipped;
+            double ns = ran > 0 ? secs * 1e9 / ran : 0.0;
+            printf("%-8s %-6s %14lu %12.2f %16.0f %14.0f %14.0f %8.1f\n", CASES[i].name, name, m->cycles,
+                ns, m->cycles / secs, frames / secs, draw_count / secs, 100.0 * m->idle_skipped / m->cycles);
+            if (csv != NULL)
+            {
+                fprintf(csv, "%s,%s,%lu,%.6f,%.3f,%.0f,%.0f,%.0f,%lu\n", CASES[i].name, name, m->cycles, secs,
+                    ns, m->cycles / secs, frames / secs, draw_count / secs, m->idle_skipped);
+            }
+        }
+    }
+
+    // upscaler: whole frames (what a full redraw costs) and single rows (a typical sprite update)
+    // of the last screen above
+    const int SCALES[][2] = {{10, FILTER_NONE}, {20, FILTER_NONE}, {10, FILTER_SCALE2X}, {9, FILTER_SCALE3X}};
+    const char *KERNELS[] = {"scalar", "sse2", "avx2"};
+    printf("\n%-8s %-6s %14s %12s\n", "scaler", "kernel", "us/frame", "us/row");
+    for (unsigned int i = 0; i < sizeof(SCALES) / sizeof(SCALES[0]); i++)
+    {
+        scaler s;
+        scaler_init(s, SCALES[i][0], SCALES[i][1], false);
+        int pitch = DISPLAY_WIDTH * s.scale;
+        uint32_t *pixels = new uint32_t[(size_t)pitch * DISPLAY_HEIGHT * s.scale + SCALER_PAD];
+        char name[16];
+        snprintf(name, sizeof(name), "x%d%s", s.scale, s.factor == 1 ? "" : (s.factor == 2 ? "s2x" : "s3x"));
+        for (unsigned int k = 0; k < sizeof(KERNELS) / sizeof(KERNELS[0]); k++)
+        {
+            if (scaler_set_kernel(s, KERNELS[k]) != 0)
+            {
+                continue;
+            }
+            const int reps = 500;
+            struct timespec start, mid, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int r = 0; r < reps; r++)
+            {
+                scaler_draw(s, m->display.rows[0], DISPLAY_WORDS, DISPLAY_WIDTH, DISPLAY_HEIGHT, 0, DISPLAY_HEIGHT, pixels,
+                    pitch);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &mid);
+            for (int r = 0; r < reps * DISPLAY_HEIGHT; r++)
+            {
+                scaler_draw(s, m->display.rows[0], DISPLAY_WORDS, DISPLAY_WIDTH, DISPLAY_HEIGHT, r % DISPLAY_HEIGHT, 1,
+                    pixels + (size_t)(r % DISPLAY_HEIGHT) * s.scale * pitch, pitch);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double frame_us = ((mid.tv_sec - start.tv_sec) * 1e9 + (mid.tv_nsec - start.tv_nsec)) / reps / 1e3;
+            double row_us = ((end.tv_sec - mid.tv_sec) * 1e9 + (end.tv_nsec - mid.tv_nsec)) / reps / DISPLAY_HEIGHT / 1e3;
+            printf("%-8s %-6s %14.2f %12.2f\n", name, KERNELS[k], frame_us, row_us);
+        }
+        delete[] pixels;
+    }
+
+    // audio renderer: one callback buffer, with a 50ms tone every 100ms (an edge
+    // in most small buffers), against the time the buffer takes to play
+    const int BUFFERS[] = {64, 256, 1024};
+    printf("\n%-8s %14s %12s\n", "audio", "us/buffer", "% of play");
+    for (unsigned int i = 0; i < sizeof(BUFFERS) / sizeof(BUFFERS[0]); i++)
+    {
+        audio_player *p = new audio_player();
+        audio_init(*p, AUDIO_RATE, false, 0);
+        int16_t *samples = new int16_t[BUFFERS[i]];
+        // a minute of sound
+        int count = 60 * AUDIO_RATE / BUFFERS[i];
+        uint64_t tone = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int b = 0; b < count; b++)
+        {
+            // queue the tones that start in this buffer, as the CPU would have by now
+            uint64_t until = (uint64_t)(b + 1) * BUFFERS[i] * 1000000000UL / AUDIO_RATE;
+            while (tone < until)
+            {
+                audio_post(p->ring, tone, tone + 50000000UL);
+                tone = tone + 100000000UL;
+            }
+            audio_render(*p, samples, BUFFERS[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double buffer_us = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / count / 1e3;
+        double play_us = BUFFERS[i] * 1e6 / AUDIO_RATE;
+        char name[16];
+        snprintf(name, sizeof(name), "%d", BUFFERS[i]);
+        printf("%-8s %14.2f %12.3f\n", name, buffer_us, 100 * buffer_us / play_us);
+        delete[] samples;
+        delete p;
+    }
+
+    if (csv != NULL)
+    {
+        fclose(csv);
+        printf("results written to %s\n", out);
+    }
+    delete m;
+    return 0;
+}
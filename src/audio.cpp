@@ -0,0 +1,272 @@
+// sound timer audio: tone ring, renderer and WAV writer (see audio.h)
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "audio.h"
+
+// sample number that plays at ns (0 for anything before sample 0)
+static uint64_t sample_at(const audio_player &p, uint64_t ns)
+{
+    if (ns <= p.base)
+    {
+        return 0;
+    }
+    uint64_t d = ns - p.base;
+    // split into seconds so long runs don't overflow
+    return d / 1000000000UL * p.rate + d % 1000000000UL * p.rate / 1000000000UL;
+}
+
+// ns from sample 0 to a sample
+static uint64_t sample_ns(const audio_player &p, uint64_t sample)
+{
+    return sample / p.rate * 1000000000UL + sample % p.rate * 1000000000UL / p.rate;
+}
+
+void audio_init(audio_player &p, int rate, bool realtime, int buffer)
+{
+    p.ring.head.store(0);
+    p.ring.tail.store(0);
+    p.ring.realtime = realtime;
+    p.ring.last = {0, 0};
+    p.ring.dropped = 0;
+    p.rate = rate;
+    // band-limited square wave: its odd harmonics up to the Nyquist limit, at a
+    // quarter of full scale (leaves room for the overshoot at the edges)
+    for (int i = 0; i < AUDIO_TABLE_SIZE; i++)
+    {
+        double x = 2 * M_PI * i / AUDIO_TABLE_SIZE;
+        double sum = 0;
+        for (int k = 1; k * AUDIO_TONE_HZ < rate / 2; k = k + 2)
+        {
+            sum = sum + sin(k * x) / k;
+        }
+        p.wave[i] = (int16_t)(sum * 4 / M_PI * 8192);
+    }
+    // raised cosine fade, 0 to 1
+    for (int i = 0; i <= AUDIO_RAMP; i++)
+    {
+        p.ramp[i] = (int16_t)(32767 * (1 - cos(M_PI * i / AUDIO_RAMP)) / 2);
+    }
+    p.step = (uint32_t)((double)AUDIO_TONE_HZ * 4294967296.0 / rate);
+    p.phase = 0;
+    p.level = 0;
+    p.on = 0;
+    p.off = 0;
+    p.pos = 0;
+    p.base = 0;
+    // two buffers: the one being rendered plays after the one ahead of it
+    p.latency = realtime ? 2 * sample_ns(p, buffer) : 0;
+    p.anchored = false;
+}
+
+void audio_start(audio_player &p, uint64_t ns)
+{
+    p.base = ns;
+}
+
+bool audio_post(audio_ring &ring, uint64_t start, uint64_t stop)
+{
+    // nothing changes if the last tone queued ends at the same time, or if both
+    // are silence from here on (e.g. a game setting the timer every frame)
+    if (start >= ring.last.start && (stop == ring.last.stop || (stop <= start && start >= ring.last.stop)))
+    {
+        return true;
+    }
+    unsigned int head = ring.head.load(std::memory_order_relaxed);
+    // acquire pairs with the consumer's release, so the slot is free before we write it
+    if (head - ring.tail.load(std::memory_order_acquire) == AUDIO_RING_SIZE)
+    {
+        ring.dropped = ring.dropped + 1;
+        return false;
+    }
+    ring.events[head & (AUDIO_RING_SIZE - 1)] = {start, stop};
+    ring.head.store(head + 1, std::memory_order_release);
+    ring.last = {start, stop};
+    return true;
+}
+
+// consumer side: the oldest queued tone, without taking it
+static bool ring_peek(audio_ring &ring, tone_event &ev)
+{
+    unsigned int tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail == ring.head.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    ev = ring.events[tail & (AUDIO_RING_SIZE - 1)];
+    return true;
+}
+
+// consumer side: hand the oldest slot back to the producer
+static void ring_drop(audio_ring &ring)
+{
+    ring.tail.store(ring.tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// render n samples with the tone on or off, fading in or out first
+static void render_span(audio_player &p, int16_t *out, int n, bool sounding)
+{
+    int i = 0;
+    int target = sounding ? AUDIO_RAMP : 0;
+    for (; i < n && p.level != target; i++)
+    {
+        p.level = p.level + (sounding ? 1 : -1);
+        out[i] = (int16_t)((p.wave[p.phase >> (32 - AUDIO_TABLE_BITS)] * p.ramp[p.level]) >> 15);
+        p.phase = p.phase + p.step;
+    }
+    if (!sounding)
+    {
+        // once silent, the next tone starts from the top of the wave
+        if (p.level == 0)
+        {
+            p.phase = 0;
+        }
+        memset(out + i, 0, (n - i) * sizeof(int16_t));
+        return;
+    }
+    for (; i < n; i++)
+    {
+        out[i] = p.wave[p.phase >> (32 - AUDIO_TABLE_BITS)];
+        p.phase = p.phase + p.step;
+    }
+}
+
+void audio_render(audio_player &p, int16_t *out, int count)
+{
+    uint64_t end = p.pos + count;
+    uint64_t pos = p.pos;
+    while (pos < end)
+    {
+        // take every tone that has started by this sample (one posted too late
+        // for its own sample starts here)
+        tone_event ev;
+        bool next = ring_peek(p.ring, ev);
+        while (next && sample_at(p, ev.start) <= pos)
+        {
+            p.on = sample_at(p, ev.start);
+            p.off = sample_at(p, ev.stop);
+            ring_drop(p.ring);
+            next = ring_peek(p.ring, ev);
+        }
+        // run to the next change: the next tone, the end of this one, or the end of the buffer
+        uint64_t until = end;
+        if (next && sample_at(p, ev.start) < until)
+        {
+            until = sample_at(p, ev.start);
+        }
+        bool sounding = pos < p.off;
+        if (sounding && p.off < until)
+        {
+            until = p.off;
+        }
+        render_span(p, out + (pos - p.pos), (int)(until - pos), sounding);
+        pos = until;
+    }
+    p.pos = end;
+}
+
+void audio_fill(audio_player &p, int16_t *out, int count)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // place this buffer's first sample latency behind now, so every tone that
+    // starts in it was posted before the callback ran
+    uint64_t want = now.tv_sec * 1000000000UL + now.tv_nsec - p.latency;
+    uint64_t at = p.base + sample_ns(p, p.pos);
+    // the device clock drifts from ours: line up again on the first callback, if
+    // a callback comes more than a buffer early, or after a stall
+    if (!p.anchored || at > want + p.latency / 2 || at + p.latency < want)
+    {
+        p.base = want - sample_ns(p, p.pos);
+        p.anchored = true;
+    }
+    audio_render(p, out, count);
+}
+
+// little-endian field of a WAV header
+static void put_le(unsigned char *at, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        at[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+// 44-byte RIFF header for 16-bit mono PCM, sized for the samples written so far
+static void write_header(wav_writer &w)
+{
+    unsigned char h[44];
+    uint32_t data = w.samples * sizeof(int16_t);
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 36 + data, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);
+    // PCM, 1 channel
+    put_le(h + 20, 1, 2);
+    put_le(h + 22, 1, 2);
+    put_le(h + 24, w.player.rate, 4);
+    put_le(h + 28, w.player.rate * sizeof(int16_t), 4);
+    put_le(h + 32, sizeof(int16_t), 2);
+    put_le(h + 34, 16, 2);
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, data, 4);
+    fwrite(h, 1, sizeof(h), w.file);
+}
+
+int wav_open(wav_writer &w, const char *filename)
+{
+    w.file = fopen(filename, "wb");
+    if (w.file == NULL)
+    {
+        printf("ERROR: could not create WAV file %s\n", filename);
+        return 1;
+    }
+    w.samples = 0;
+    audio_init(w.player, AUDIO_RATE, false, 0);
+    // sizes are filled in by wav_close
+    write_header(w);
+    return 0;
+}
+
+void wav_write(wav_writer &w, uint64_t ns)
+{
+    uint64_t end = sample_at(w.player, ns);
+    while (w.player.pos < end)
+    {
+        int n = end - w.player.pos < 1024 ? (int)(end - w.player.pos) : 1024;
+        audio_render(w.player, w.chunk, n);
+        // samples in host order (little-endian on the hosts this builds for)
+        fwrite(w.chunk, sizeof(int16_t), n, w.file);
+        w.samples = w.samples + n;
+    }
+}
+
+int wav_close(wav_writer &w)
+{
+    if (w.player.ring.dropped > 0)
+    {
+        printf("WARNING: %lu tone changes were dropped (sound queue full)\n", w.player.ring.dropped);
+    }
+    int status = 0;
+    if (fseek(w.file, 0, SEEK_SET) != 0)
+    {
+        status = 1;
+    }
+    else
+    {
+        write_header(w);
+    }
+    if (ferror(w.file))
+    {
+        status = 1;
+    }
+    if (fclose(w.file) != 0)
+    {
+        status = 1;
+    }
+    if (status != 0)
+    {
+        printf("%s","ERROR: could not write the WAV file\n");
+    }
+    return status;
+}
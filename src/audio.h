@@ -0,0 +1,121 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+// sound stage: turns sound timer changes into samples
+// the CPU posts each tone (the time it starts and the time the timer runs out)
+// into a lock-free ring; the consumer - SDL's audio callback, or the headless
+// WAV writer - renders them from precomputed tables starting and stopping on
+// the exact sample they fall on, with no locks or allocation on either side
+// this header does not pull in SDL
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+// output sample rate the device is asked for (and WAV files are written at)
+#define AUDIO_RATE 48000
+
+// device buffer size in samples, unless --audio-buffer picks another
+#define AUDIO_BUFFER_DEFAULT 512
+
+// pitch of the buzzer
+#define AUDIO_TONE_HZ 440
+
+// one period of the tone (a power of 2, so the phase wraps for free)
+#define AUDIO_TABLE_BITS 10
+#define AUDIO_TABLE_SIZE (1 << AUDIO_TABLE_BITS)
+
+// samples a tone fades in and out over, so starts and stops don't click
+#define AUDIO_RAMP 96
+
+// number of queued tones (must be a power of 2)
+#define AUDIO_RING_SIZE 256
+
+// one tone: sounds from start until stop and replaces whatever was playing
+// (stop <= start is silence from start on)
+// times are ns on the consumer's clock - CLOCK_MONOTONIC for live playback,
+// emulated time (see CPU_timer_ns) for a WAV
+struct tone_event
+{
+    uint64_t start;
+    uint64_t stop;
+};
+
+// single-producer/single-consumer queue of tones, CPU thread -> audio thread
+struct audio_ring
+{
+    tone_event events[AUDIO_RING_SIZE];
+    // next slot to write (only the producer stores it)
+    std::atomic<unsigned int> head;
+    // next slot to read (only the consumer stores it)
+    std::atomic<unsigned int> tail;
+    // true = played live (stamps are CLOCK_MONOTONIC), false = emulated time
+    bool realtime;
+    // producer side: the last tone queued, so repeats that change nothing aren't
+    // queued again, and the tones dropped because the ring was full
+    tone_event last;
+    unsigned long dropped;
+};
+
+// consumer side: the ring plus everything the renderer needs
+// all of it is set up by audio_init - rendering never allocates
+struct audio_player
+{
+    audio_ring ring;
+    int rate;
+    // one period of a band-limited square wave, and the fade gain curve (Q15)
+    int16_t wave[AUDIO_TABLE_SIZE];
+    int16_t ramp[AUDIO_RAMP + 1];
+    // phase accumulator (the top AUDIO_TABLE_BITS index wave) and its step per sample
+    uint32_t phase;
+    uint32_t step;
+    // position in ramp (0 = silent, AUDIO_RAMP = full volume)
+    int level;
+    // tone being played, as sample numbers
+    uint64_t on;
+    uint64_t off;
+    // next sample to render, and the ns that sample 0 plays at
+    uint64_t pos;
+    uint64_t base;
+    // realtime: how far behind the callback's clock samples are placed, and
+    // whether base has been set by a first callback yet
+    uint64_t latency;
+    bool anchored;
+};
+
+// set a player up for rate samples/s
+// a realtime player places samples from the callback's clock, buffer samples at a time
+void audio_init(audio_player &p, int rate, bool realtime, int buffer);
+
+// non-realtime players: sample 0 plays at ns
+void audio_start(audio_player &p, uint64_t ns);
+
+// producer side: queue a tone, returns false if the ring is full (it is dropped)
+bool audio_post(audio_ring &ring, uint64_t start, uint64_t stop);
+
+// render the next count samples (16-bit mono), starting each queued tone on its sample
+void audio_render(audio_player &p, int16_t *out, int count);
+
+// audio callback body for a realtime player: line the next samples up with the
+// clock, then render them
+void audio_fill(audio_player &p, int16_t *out, int count);
+
+// headless sound output: renders a player into a 16-bit mono WAV file
+struct wav_writer
+{
+    FILE *file;
+    unsigned long samples;
+    audio_player player;
+    int16_t chunk[1024];
+};
+
+// create a WAV file (header sizes are filled in by wav_close)
+// returns non-zero if the file can't be created
+int wav_open(wav_writer &w, const char *filename);
+
+// render every sample before ns (emulated time) into the file
+void wav_write(wav_writer &w, uint64_t ns);
+
+// finish the header and close the file, returns non-zero on a write error
+int wav_close(wav_writer &w);
+
+#endif
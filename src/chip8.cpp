@@ -8,21 +8,49 @@
 //#include <stdlib.h>
 #include <time.h>
 #include <thread>
+#include <atomic>
 #include <getopt.h>
 #include "cpu.h"
 #include "iohandle.h"
+#include "headless.h"
+#include "jit.h"
+#include "render.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "keyring.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "movie.h"
+#include "romcache.h"
+#include "scaler.h"
+#include "audio.h"
 
-// shutdown indicator
-bool shutdown_flag = false;
+// shutdown indicator (read and set by the CPU, input and render threads)
+std::atomic<bool> shutdown_flag(false);
 
-// vector to store keystates
-std::vector<unsigned char> KEYS(16);
+// set by the render thread once the SDL window is up
+std::atomic<bool> screen_ready(false);
 
-// 8 bit delay timer
-unsigned char DEL_TIME = 0;
+// the emulated machine (registers, memory, keys, timers, display)
+Chip8Machine MACHINE;
 
-// 8-bit sound timer
-unsigned char SOUND_TIME = 0;
+// key events from the input thread to the CPU thread
+key_ring KEY_EVENTS;
+// time the last burst's input window ended: events stamped before it have been
+// taken, later ones belong to the next burst
+unsigned long input_ns = 0;
+
+// sound timer output, played from SDL's audio callback
+audio_player AUDIO;
+// set by the render thread once the audio device is open
+std::atomic<bool> audio_ready(false);
+
+// per-frame rewind history (paced mode)
+rewind_buffer REWIND;
+
+// movie being recorded (--record)
+movie_recorder RECORDER;
+bool recording = false;
 
 // arguments
 int c;
@@ -31,43 +59,521 @@ int sval = 0;
 int xval = 0;
 int kflag = 0;
 char *fval = NULL;
+int headless_flag = 0;
+char *input_val = NULL;
+unsigned long cycles_val = 0;
+int jit_flag = 0;
+unsigned long ips_val = 0;
+int spin_flag = 0;
+int turbo_flag = 0;
+unsigned int clock_val = TIMER_WALL;
+char *load_state_val = NULL;
+char *save_state_val = NULL;
+// rewind history cap in MB (-1 = not given)
+long rewind_val = -1;
+char *record_val = NULL;
+char *replay_val = NULL;
+// random seed (--seed, or the time at startup)
+unsigned long seed_val = 0;
+int seed_flag = 0;
+// fast-forward: emulated frames per real frame (0 = as fast as the host allows)
+// and the most frames per second to present while skipping
+unsigned long ff_speed_val = 0;
+unsigned long ff_fps_val = 20;
+// upscaling filter (FILTER_*) and scanlines
+int filter_val = FILTER_NONE;
+int scanlines_flag = 0;
+// fast-forward through polling loops (--no-idle-skip turns it off)
+int idle_skip_flag = 1;
+// headless sound output file, and the audio device buffer in samples (0 = no sound)
+char *wav_val = NULL;
+unsigned long audio_buffer_val = AUDIO_BUFFER_DEFAULT;
 
-// main cpu function
-void cpu_thread()
+// fast-forward toggle (Tab), set by run_commands
+bool fast_forward = false;
+
+// file the F5/F9 hotkeys save to and load from (--save-state, or this default)
+const char *QUICK_STATE = "quicksave.c8s";
+
+// long options
+struct option long_opts[] = {
+    {"headless", no_argument, NULL, 'H'},
+    {"input", required_argument, NULL, 'i'},
+    {"cycles", required_argument, NULL, 'n'},
+    {"jit", no_argument, NULL, 'J'},
+    {"ips", required_argument, NULL, 'I'},
+    {"spin", no_argument, NULL, 'S'},
+    {"turbo", no_argument, NULL, 'T'},
+    {"clock", required_argument, NULL, 'C'},
+    {"load-state", required_argument, NULL, 'L'},
+    {"save-state", required_argument, NULL, 'V'},
+    {"rewind", required_argument, NULL, 'R'},
+    {"record", required_argument, NULL, 'M'},
+    {"replay", required_argument, NULL, 'P'},
+    {"seed", required_argument, NULL, 'E'},
+    {"ff-speed", required_argument, NULL, 'G'},
+    {"ff-fps", required_argument, NULL, 'Q'},
+    {"filter", required_argument, NULL, 'X'},
+    {"scanlines", no_argument, NULL, 'Y'},
+    {"no-idle-skip", no_argument, NULL, 'Z'},
+    {"wav", required_argument, NULL, 'W'},
+    {"audio-buffer", required_argument, NULL, 'U'},
+    {NULL, 0, NULL, 0}
+};
+
+// act on hotkeys the input thread queued (KEY_CMD_BIT bits)
+void run_commands(unsigned int commands)
 {
-    printf("%s","CPU thread started\n");
-    // first, init the CPU
-    init_CPU(xval, fval);
-    // pause to let screen init
-    nanosleep((const struct timespec[]){{1, 0L}}, NULL);
+    const char *state = save_state_val != NULL ? save_state_val : QUICK_STATE;
+    if (commands & KEY_CMD_BIT(KEY_CMD_SAVE))
+    {
+        snapshot_save(MACHINE, state);
+    }
+    if ((commands & KEY_CMD_BIT(KEY_CMD_LOAD)) && recording)
+    {
+        // a movie can only replay what the machine did on its own
+        printf("%s","state loads are disabled while recording a movie\n");
+    }
+    else if (commands & KEY_CMD_BIT(KEY_CMD_LOAD))
+    {
+        snapshot_load(MACHINE, state);
+        // show the restored screen
+        MACHINE.io->draw_screen(MACHINE.display, DISPLAY_ALL_ROWS);
+    }
+    if (commands & KEY_CMD_BIT(KEY_CMD_FASTFWD))
+    {
+        fast_forward = !fast_forward;
+    }
+}
+
+// connect the machine's sound timer to the audio device, or silence it
+// (fast-forward), CPU thread only
+void sound_attach(bool on)
+{
+    if (!audio_ready || turbo_flag == 1)
+    {
+        return;
+    }
+    if (on)
+    {
+        // the next CPU_set_clock posts the tone that is still running
+        MACHINE.audio = &AUDIO.ring;
+        return;
+    }
+    if (MACHINE.audio != NULL)
+    {
+        unsigned long now = key_stamp();
+        audio_post(*MACHINE.audio, now, now);
+        MACHINE.audio = NULL;
+    }
+}
+
+// presents frames at no more than ff_fps_val per second while draws are skipped
+struct frame_limiter
+{
+    struct timespec last;
+    unsigned long presented;
+};
+
+void limiter_init(frame_limiter &fl)
+{
+    clock_gettime(CLOCK_MONOTONIC, &fl.last);
+    fl.presented = 0;
+}
+
+// publish the display if it changed and the last present was long enough ago
+void limiter_present(frame_limiter &fl, const struct timespec &now)
+{
+    long ns = (now.tv_sec - fl.last.tv_sec) * 1000000000L + (now.tv_nsec - fl.last.tv_nsec);
+    if (ns >= 1000000000L / (long)ff_fps_val && render_flush(MACHINE.display))
+    {
+        fl.last = now;
+        fl.presented = fl.presented + 1;
+    }
+}
+
+// apply queued key changes stamped before until, and record them in the movie
+// returns the hotkeys pressed
+unsigned int take_input(unsigned long until)
+{
+    unsigned int commands = key_ring_apply(KEY_EVENTS, MACHINE, until);
+    if (recording)
+    {
+        movie_record_keys(RECORDER, MACHINE);
+    }
+    return commands;
+}
+
+// take every queued key change and hotkey (call between bursts)
+void poll_input()
+{
+    input_ns = key_stamp();
+    run_commands(take_input(input_ns));
+}
+
+// run the CPU up to end_cycle as one frame's burst, applying each key event that
+// came in since the last burst at the cycle its stamp maps to: the burst stands
+// for the real time since the last one started, spread evenly over its
+// instructions, so keys land one frame late but as far apart as they were
+// pressed (split the same way as scripted input in run_machine_headless)
+// hotkeys are acted on when the burst ends; returns the CPU status
+int run_burst(unsigned long end_cycle)
+{
+    unsigned long from = input_ns;
+    unsigned long now = key_stamp();
+    input_ns = now;
+    unsigned long start = MACHINE.cycles;
+    unsigned long budget = end_cycle > start ? end_cycle - start : 0;
+    unsigned long span = now > from ? now - from : 1;
+    unsigned int commands = 0;
+    int status = 0;
+    key_event ev;
+    // events stamped after now are the next burst's
+    while (status == 0 && key_ring_peek(KEY_EVENTS, ev) && ev.stamp < now)
+    {
+        // first cycle at or after the event's time (anything older lands at the start)
+        unsigned long at = start;
+        if (ev.stamp > from)
+        {
+            at = start + ((ev.stamp - from) * budget + span - 1) / span;
+        }
+        if (at >= end_cycle)
+        {
+            // the next burst applies it first
+            break;
+        }
+        if (at > MACHINE.cycles)
+        {
+            status = CPU_run(MACHINE, at);
+        }
+        // with every other event stamped at the same time
+        commands = commands | take_input(ev.stamp + 1);
+    }
+    if (status == 0)
+    {
+        status = CPU_run(MACHINE, end_cycle);
+    }
+    run_commands(commands);
+    return status;
+}
+
+// longest a parked CPU thread (FX0A waiting for a key) sleeps before checking
+// for shutdown and running the frames that went by
+#define KEY_PARK_MS 100
+
+// turbo mode: run the CPU flat out with no throttle
+// the 60Hz timers run on the virtual clock, every ips/60 instructions, so programs
+// see the same timing they would at --ips, just sooner
+void turbo_loop()
+{
+    unsigned long tick_cycles = ips_val / SCHED_HZ;
+    CPU_set_clock(MACHINE, TIMER_VIRTUAL, tick_cycles);
+    // draws are only presented at --ff-fps, so the CPU never waits on frame hand-off
+    frame_limiter limiter;
+    limiter_init(limiter);
+    render_set_skip(true);
+    // live rate report, once a second
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    unsigned long last_cycles = MACHINE.cycles;
+    printf("%s","running (turbo)...\n");
+    while (!shutdown_flag)
+    {
+        // key changes and hotkeys land between bursts
+        poll_input();
+        // run up to the next timer tick
+        if (CPU_run(MACHINE, (MACHINE.cycles / tick_cycles + 1) * tick_cycles) != 0)
+        {
+            shutdown_flag = true;
+            break;
+        }
+        PROFILE_POLL();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        limiter_present(limiter, now);
+        // FX0A is waiting for a key: sleep until input comes (the virtual clock
+        // only moves as the CPU runs, so there is nothing to catch up on)
+        if (MACHINE.key_wait && !shutdown_flag)
+        {
+            render_flush(MACHINE.display);
+            while (!shutdown_flag && !key_ring_wait(KEY_EVENTS, KEY_PARK_MS))
+            {
+                PROFILE_POLL();
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        }
+        double secs = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        if (secs >= 1.0)
+        {
+            printf("turbo: %.2f MIPS (%.1fx of %lu instructions/s)\n", (MACHINE.cycles - last_cycles) / secs / 1e6,
+                (MACHINE.cycles - last_cycles) / secs / ips_val, ips_val);
+            last = now;
+            last_cycles = MACHINE.cycles;
+        }
+    }
+    render_set_skip(false);
+}
+
+// fast-forward (paced mode): run several emulated frames, or as many as fit, per
+// real frame and present only some of them
+// the timers switch to the virtual clock so programs waiting on them speed up too
+struct ff_state
+{
+    bool on;
+    frame_limiter limiter;
+    struct timespec start;
+    unsigned long start_cycles;
+};
+
+void ff_switch(ff_state &ff, bool on)
+{
+    unsigned long tick_cycles = ips_val / SCHED_HZ;
+    ff.on = on;
+    if (on)
+    {
+        // fast-forward is silent
+        sound_attach(false);
+        CPU_set_clock(MACHINE, TIMER_VIRTUAL, tick_cycles);
+        render_set_skip(true);
+        limiter_init(ff.limiter);
+        ff.start = ff.limiter.last;
+        ff.start_cycles = MACHINE.cycles;
+        printf("%s","fast-forward on\n");
+        return;
+    }
+    sound_attach(true);
+    CPU_set_clock(MACHINE, clock_val, tick_cycles);
+    render_set_skip(false);
+    // show where it stopped
+    MACHINE.io->draw_screen(MACHINE.display, DISPLAY_ALL_ROWS);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - ff.start.tv_sec) + (now.tv_nsec - ff.start.tv_nsec) / 1e9;
+    unsigned long frames = (MACHINE.cycles - ff.start_cycles) / tick_cycles;
+    printf("fast-forward off: %lu frames in %.1f s (%.1fx), %lu presented\n", frames, secs,
+        secs > 0 ? frames / secs / SCHED_HZ : 0.0, ff.limiter.presented);
+}
+
+// run one real frame's worth of fast-forward, returns the CPU status
+int ff_frame(ff_state &ff, frame_scheduler &sched)
+{
+    unsigned long budget = sched_frame_budget(sched);
+    int status = 0;
+    if (ff_speed_val > 0)
+    {
+        status = CPU_run(MACHINE, MACHINE.cycles + ff_speed_val * budget);
+    }
+    else
+    {
+        // emulated frames back to back until just before the real frame ends
+        unsigned long tick_cycles = ips_val / SCHED_HZ;
+        do
+        {
+            status = CPU_run(MACHINE, (MACHINE.cycles / tick_cycles + 1) * tick_cycles);
+        } while (status == 0 && sched_time_left(sched) > SCHED_SPIN_NS);
+    }
+    return status;
+}
+
+// FX0A is waiting for a key: sleep until input comes instead of running frames
+// that would only wait. every KEY_PARK_MS, and on waking, the frames that went by
+// are run (FX0A lets each one pass at once) and recorded for rewind, so the
+// instruction count, the virtual timers and the history come out as if they had
+// run. fast-forward has no real-time rate to keep, so it runs none. any input
+// wakes it - the caller's next burst takes keys and hotkeys as usual
+void park_for_key(frame_scheduler &sched, bool ff, bool rewind)
+{
+    // show the screen the program is waiting on (fast-forward may have skipped it)
+    render_flush(MACHINE.display);
+    // a frame deadline has gone by, so the current frame is the caller's to run
+    bool waited = false;
+    while (!shutdown_flag)
+    {
+        bool woke = key_ring_wait(KEY_EVENTS, KEY_PARK_MS);
+        PROFILE_POLL();
+        unsigned long passed = sched_passed(sched);
+        unsigned long frames = passed;
+        if (passed > 0 && !waited)
+        {
+            // the frame that parked has already run
+            frames = passed - 1;
+            waited = true;
+        }
+        for (unsigned long i = 0; i < frames && !ff && MACHINE.key_wait; i++)
+        {
+            if (CPU_run(MACHINE, MACHINE.cycles + sched_frame_budget(sched)) != 0)
+            {
+                shutdown_flag = true;
+                return;
+            }
+            if (rewind)
+            {
+                rewind_push(REWIND, MACHINE);
+            }
+        }
+        if (woke)
+        {
+            break;
+        }
+    }
+    // the frames that went by ran without it, so the event that woke it is
+    // applied at the start of the next burst
+    input_ns = key_stamp();
+    if (!waited && !shutdown_flag)
+    {
+        // woke in the frame that parked - finish it as usual
+        sched_wait(sched);
+    }
+}
 
+// normal mode: run at ips_val instructions per second
+void paced_loop()
+{
     // run CPU cycles in a loop, as a long as shutdown variable is false
+    // each 60Hz frame runs ips/60 instructions in one burst, then sleeps until
+    // the next frame deadline - this is essentially the "clock"
+    frame_scheduler sched;
+    sched_init(sched, ips_val, spin_flag == 1);
+    // one history frame per 60Hz frame, 0 MB = no rewind (nor while recording a movie)
+    bool rewind = rewind_val != 0 && !recording && rewind_init(REWIND, (size_t)rewind_val << 20) == 0;
+    ff_state ff;
+    ff.on = false;
+    unsigned long start_cycles = MACHINE.cycles;
+    input_ns = key_stamp();
     printf("%s","running...\n");
     while (!shutdown_flag)
     {
-        if(CPU_cycle(KEYS, DEL_TIME, SOUND_TIME) != 0)
+        // hotkeys are taken with the keys, by the last frame's burst
+        if (fast_forward != ff.on)
+        {
+            ff_switch(ff, fast_forward);
+        }
+        // holding the rewind key steps back one frame per frame instead of running
+        if (rewind && (KEY_EVENTS.held & KEY_CMD_BIT(KEY_CMD_REWIND)))
+        {
+            // nothing runs, so everything queued is taken now (the key's release too)
+            poll_input();
+            if (rewind_step(REWIND, MACHINE) == 0)
+            {
+                MACHINE.io->draw_screen(MACHINE.display, DISPLAY_ALL_ROWS);
+                render_flush(MACHINE.display);
+            }
+            sched_wait(sched);
+            continue;
+        }
+        if (ff.on)
+        {
+            // fast-forward has no real-time rate, so input is taken between frames
+            poll_input();
+            if (ff_frame(ff, sched) != 0)
+            {
+                shutdown_flag = true;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            limiter_present(ff.limiter, now);
+        }
+        else if (run_burst(MACHINE.cycles + sched_frame_budget(sched)) != 0)
         {
             // CPU cycle return non-zero
             // shutdown bool = true
             shutdown_flag = true;
         }
-        // throttle the CPU - sleep until time for next clock cycle
-        // this is essentially the "clock"
-        switch (sval)
+        if (rewind)
         {
-        case 0:
-            nanosleep((const struct timespec[]){{0, 10000L}}, NULL);
-            break;
-        case 1:
-            nanosleep((const struct timespec[]){{0, 100000L}}, NULL);
-            break;
-        case 2:
-            nanosleep((const struct timespec[]){{0, 1000000L}}, NULL);
-            break;
-        default:
-            nanosleep((const struct timespec[]){{0, 100000L}}, NULL);
-            break;
+            rewind_push(REWIND, MACHINE);
+        }
+        PROFILE_POLL();
+        if (MACHINE.key_wait && !shutdown_flag)
+        {
+            park_for_key(sched, ff.on, rewind);
+            continue;
         }
+        sched_wait(sched);
+    }
+    if (ff.on)
+    {
+        ff_switch(ff, false);
+    }
+    sched_report(sched, MACHINE.cycles - start_cycles);
+    if (AUDIO.ring.dropped > 0)
+    {
+        printf("WARNING: %lu tone changes were dropped (sound queue full)\n", AUDIO.ring.dropped);
+    }
+    if (MACHINE.idle_skipped > 0)
+    {
+        printf("idle loops: %lu of %lu instructions skipped\n", MACHINE.idle_skipped, MACHINE.cycles);
+    }
+    if (rewind)
+    {
+        rewind_report(REWIND);
+        rewind_close(REWIND);
+    }
+}
+
+// main cpu function
+void cpu_thread()
+{
+    printf("%s","CPU thread started\n");
+    // first, init the CPU
+    // draws go to the render thread through the triple buffer
+    if (init_CPU(MACHINE, xval, fval, &RENDER_IO) != 0)
+    {
+        shutdown_flag = true;
+        return;
+    }
+    CPU_seed(MACHINE, seed_val);
+    MACHINE.idle_skip = idle_skip_flag == 1;
+    if (jit_flag == 1)
+    {
+        jit_init(MACHINE);
+    }
+    // pause to let screen init
+    nanosleep((const struct timespec[]){{1, 0L}}, NULL);
+    // sound timer tones to the audio device, if it opened (turbo runs are silent)
+    sound_attach(true);
+    // delay/sound timers on the selected clock (wall by default)
+    CPU_set_clock(MACHINE, clock_val, ips_val / SCHED_HZ);
+    // resume from a save state
+    if (load_state_val != NULL)
+    {
+        if (snapshot_load(MACHINE, load_state_val) != 0)
+        {
+            shutdown_flag = true;
+            return;
+        }
+        MACHINE.io->draw_screen(MACHINE.display, DISPLAY_ALL_ROWS);
+    }
+    // record from power-on (the machine was just seeded with seed_val), with the
+    // timers on the virtual clock so they only depend on the instruction count
+    if (record_val != NULL)
+    {
+        clock_val = TIMER_VIRTUAL;
+        CPU_set_clock(MACHINE, clock_val, ips_val / SCHED_HZ);
+        if (movie_record_start(RECORDER, record_val, MACHINE, seed_val, ips_val / SCHED_HZ) != 0)
+        {
+            shutdown_flag = true;
+            return;
+        }
+        recording = true;
+    }
+
+    if (turbo_flag == 1)
+    {
+        turbo_loop();
+    }
+    else
+    {
+        paced_loop();
+    }
+    if (recording)
+    {
+        movie_record_stop(RECORDER, MACHINE);
+        recording = false;
+    }
+    // keep the session for next time
+    if (save_state_val != NULL)
+    {
+        snapshot_save(MACHINE, save_state_val);
     }
 }
 
@@ -75,42 +581,75 @@ void cpu_thread()
 void input_thread()
 {
     printf("%s","Input thread started\n");
-    // pause to let screen init
-    nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
+    // wait for the render thread to init the screen
+    while (!screen_ready && !shutdown_flag)
+    {
+        nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
+    }
     // loop while the shudown flag is off
     while (!shutdown_flag)
     {
-        // get input to shutdown bool (exit event) and KEYS (keystate event)
-        SDL_input_event_handler(shutdown_flag, KEYS, kflag);
-        // sleep 10ns just as a simple throttle to avoid a constant poll
-        nanosleep((const struct timespec[]){{0, 10L}}, NULL);
+        // wait for input - shutdown bool (exit event) and key events for the CPU thread
+        SDL_input_event_handler(shutdown_flag, KEY_EVENTS, kflag);
     }
-    // exit while loop == shutdown
-    SDL_screen_close();
+    // the CPU thread may be parked waiting for a key
+    key_ring_wake(KEY_EVENTS);
 }
 
-// timer thread to handle the sound and delay timers
-// decriment at a rate of 60Hz
-void timer_thread()
+// render thread: owns the SDL window and presents the newest published frame
+// once per display refresh, so the CPU never waits on the renderer
+void render_thread()
 {
-    printf("%s","Timer thread started\n");
+    printf("%s","Render thread started\n");
+    if (!SDL_screen_init(xval))
+    {
+        shutdown_flag = true;
+        return;
+    }
+    // sound on the same SDL instance (the window works without it)
+    if (audio_buffer_val > 0 && SDL_audio_init(AUDIO, audio_buffer_val))
+    {
+        audio_ready = true;
+    }
+    screen_ready = true;
+    // time per refresh, for pacing when there is no new frame to present
+    long refresh_ns = 1000000000L / SDL_refresh_rate();
+    // frame being shown, to work out which rows changed
+    static display_buffer shown;
+    static display_buffer frame;
     while (!shutdown_flag)
     {
-        // check if DEL_TIME is non-zero
-        if (DEL_TIME > 0)
+        if (triple_take(RENDER_FRAMES, frame))
         {
-            // subtract 1
-            DEL_TIME = DEL_TIME - 1;
+            uint64_t dirty = 0;
+            if (frame.hires != shown.hires)
+            {
+                // mode change - everything is redrawn at the new size
+                dirty = DISPLAY_ALL_ROWS;
+                shown = frame;
+            }
+            for (int i = 0; i < display_height(frame); i++)
+            {
+                if (frame.rows[i][0] != shown.rows[i][0] || frame.rows[i][1] != shown.rows[i][1])
+                {
+                    dirty = dirty | ((uint64_t)1 << i);
+                    shown.rows[i][0] = frame.rows[i][0];
+                    shown.rows[i][1] = frame.rows[i][1];
+                }
+            }
+            // present blocks until the next refresh (vsync)
+            draw_screen_vector(shown, dirty);
         }
-        // check if SOUND_TIME is non-zero
-        if (SOUND_TIME > 0)
+        else
         {
-            // subtract 1
-            SOUND_TIME = SOUND_TIME - 1;
+            // nothing new - wait out this refresh
+            struct timespec wait = {0, refresh_ns};
+            nanosleep(&wait, NULL);
         }
-        // sleep for 1/60th of a second
-        nanosleep((const struct timespec[]){{0, 16666666L}}, NULL);
     }
+    // exit while loop == shutdown
+    SDL_audio_close();
+    SDL_screen_close();
 }
 
 int main(int argc, char* argv[])
@@ -128,6 +667,27 @@ int main(int argc, char* argv[])
         printf("%s\n","    2 = faster");\
         printf("%s\n","-x: pixel graphics size (recommend 10 or 20)");
         printf("%s\n","-k: use custom tetris keybindings (optional argument)");
+        printf("%s\n","--headless: run without a display (no SDL window or input)");
+        printf("%s\n","--input: input script for headless runs (\"<cycle> <key> <state>\" per line)");
+        printf("%s\n","--cycles: stop a headless run after this many instructions (default: run until halt)");
+        printf("%s\n","--jit: run the CPU on the x86-64 recompiler (falls back to the interpreter elsewhere)");
+        printf("%s\n","--ips: exact emulation speed in instructions per second (overrides -s)");
+        printf("%s\n","--spin: sleep then spin to each frame deadline (less jitter, more CPU)");
+        printf("%s\n","--turbo: run as fast as possible, timers in virtual time, prints MIPS every second");
+        printf("%s\n","--clock: timer clock, wall (real time, default) or virtual (instruction count)");
+        printf("%s\n","--load-state: resume from a save state file");
+        printf("%s\n","--save-state: save state file, written on exit and by F5 (F9 reloads it)");
+        printf("%s\n","--rewind: rewind history size in MB, hold Backspace to rewind (default 8, 0 = off)");
+        printf("%s\n","--record: record the seed and key presses to a movie file (timers run on the virtual clock)");
+        printf("%s\n","--replay: replay a movie headless at full speed and check it ends in the recorded state");
+        printf("%s\n","--seed: seed for the random number generator (CXNN), default is the current time");
+        printf("%s\n","--ff-speed: fast-forward (Tab) speed in frames per frame (default 0 = as fast as possible)");
+        printf("%s\n","--ff-fps: most frames per second shown while fast-forwarding or in turbo (default 20)");
+        printf("%s\n","--filter: pixel-art upscaling filter, none (default), scale2x or scale3x (-x must be a multiple of 2 or 3)");
+        printf("%s\n","--scanlines: darken the bottom of each pixel row like a CRT");
+        printf("%s\n","--no-idle-skip: run polling loops instruction by instruction instead of skipping to the next timer tick");
+        printf("%s\n","--wav: write the sound of a headless run to a WAV file");
+        printf("%s\n","--audio-buffer: audio device buffer in samples, smaller = less latency (default 512, 0 = no sound)");
         printf("%s\n","EXAMPLES:");
         printf("%s\n","./chip8 -fkeypad.ch8 -s1 -x10");
         printf("%s\n","[run keypad test with default speed, pixel size 10, and default keys]");
@@ -137,7 +697,7 @@ int main(int argc, char* argv[])
     }
 
     // parse opts with "getopt"
-    while((c = getopt(argc, argv, "hks:x:f:")) != -1) 
+    while((c = getopt_long(argc, argv, "hks:x:f:", long_opts, NULL)) != -1) 
     {
         switch(c)
         {
@@ -168,6 +728,118 @@ int main(int argc, char* argv[])
             case 'f':
                 fval = optarg;
                 break;
+            case 'H':
+                headless_flag = 1;
+                break;
+            case 'i':
+                input_val = optarg;
+                break;
+            case 'n':
+                cycles_val = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                jit_flag = 1;
+                break;
+            case 'I':
+                ips_val = strtoul(optarg, NULL, 10);
+                if (ips_val < SCHED_HZ)
+                {
+                    printf("invalid ips, must be at least %d\n", SCHED_HZ);
+                    return 1;
+                }
+                break;
+            case 'S':
+                spin_flag = 1;
+                break;
+            case 'T':
+                turbo_flag = 1;
+                break;
+            case 'L':
+                load_state_val = optarg;
+                break;
+            case 'V':
+                save_state_val = optarg;
+                break;
+            case 'R':
+                rewind_val = strtol(optarg, NULL, 10);
+                if (rewind_val < 0)
+                {
+                    printf("%s","invalid rewind size, must be 0 MB or more\n");
+                    return 1;
+                }
+                break;
+            case 'M':
+                record_val = optarg;
+                break;
+            case 'P':
+                replay_val = optarg;
+                break;
+            case 'G':
+                ff_speed_val = strtoul(optarg, NULL, 10);
+                break;
+            case 'Q':
+                ff_fps_val = strtoul(optarg, NULL, 10);
+                if (ff_fps_val == 0)
+                {
+                    printf("%s","invalid ff-fps, must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'X':
+                if (strcmp(optarg, "none") == 0)
+                {
+                    filter_val = FILTER_NONE;
+                }
+                else if (strcmp(optarg, "scale2x") == 0)
+                {
+                    filter_val = FILTER_SCALE2X;
+                }
+                else if (strcmp(optarg, "scale3x") == 0)
+                {
+                    filter_val = FILTER_SCALE3X;
+                }
+                else
+                {
+                    printf("%s","invalid filter, must be none, scale2x or scale3x\n");
+                    return 1;
+                }
+                break;
+            case 'Y':
+                scanlines_flag = 1;
+                break;
+            case 'Z':
+                idle_skip_flag = 0;
+                break;
+            case 'W':
+                wav_val = optarg;
+                break;
+            case 'U':
+                audio_buffer_val = strtoul(optarg, NULL, 10);
+                if (audio_buffer_val > 8192 || (audio_buffer_val & (audio_buffer_val - 1)) != 0)
+                {
+                    printf("%s","invalid audio buffer, must be 0 or a power of 2 up to 8192\n");
+                    return 1;
+                }
+                break;
+            case 'E':
+                seed_val = strtoul(optarg, NULL, 0);
+                seed_flag = 1;
+                break;
+            case 'C':
+                if (strcmp(optarg, "wall") == 0)
+                {
+                    clock_val = TIMER_WALL;
+                }
+                else if (strcmp(optarg, "virtual") == 0)
+                {
+                    clock_val = TIMER_VIRTUAL;
+                }
+                else
+                {
+                    printf("%s","invalid clock, must be wall or virtual\n");
+                    return 1;
+                }
+                break;
             default:
                 break;
         }
@@ -186,6 +858,27 @@ int main(int argc, char* argv[])
         printf("%s\n","    2 = faster");\
         printf("%s\n","-x: pixel graphics size (recommend 10 or 20)");
         printf("%s\n","-k: use custom tetris keybindings (optional argument)");
+        printf("%s\n","--headless: run without a display (no SDL window or input)");
+        printf("%s\n","--input: input script for headless runs (\"<cycle> <key> <state>\" per line)");
+        printf("%s\n","--cycles: stop a headless run after this many instructions (default: run until halt)");
+        printf("%s\n","--jit: run the CPU on the x86-64 recompiler (falls back to the interpreter elsewhere)");
+        printf("%s\n","--ips: exact emulation speed in instructions per second (overrides -s)");
+        printf("%s\n","--spin: sleep then spin to each frame deadline (less jitter, more CPU)");
+        printf("%s\n","--turbo: run as fast as possible, timers in virtual time, prints MIPS every second");
+        printf("%s\n","--clock: timer clock, wall (real time, default) or virtual (instruction count)");
+        printf("%s\n","--load-state: resume from a save state file");
+        printf("%s\n","--save-state: save state file, written on exit and by F5 (F9 reloads it)");
+        printf("%s\n","--rewind: rewind history size in MB, hold Backspace to rewind (default 8, 0 = off)");
+        printf("%s\n","--record: record the seed and key presses to a movie file (timers run on the virtual clock)");
+        printf("%s\n","--replay: replay a movie headless at full speed and check it ends in the recorded state");
+        printf("%s\n","--seed: seed for the random number generator (CXNN), default is the current time");
+        printf("%s\n","--ff-speed: fast-forward (Tab) speed in frames per frame (default 0 = as fast as possible)");
+        printf("%s\n","--ff-fps: most frames per second shown while fast-forwarding or in turbo (default 20)");
+        printf("%s\n","--filter: pixel-art upscaling filter, none (default), scale2x or scale3x (-x must be a multiple of 2 or 3)");
+        printf("%s\n","--scanlines: darken the bottom of each pixel row like a CRT");
+        printf("%s\n","--no-idle-skip: run polling loops instruction by instruction instead of skipping to the next timer tick");
+        printf("%s\n","--wav: write the sound of a headless run to a WAV file");
+        printf("%s\n","--audio-buffer: audio device buffer in samples, smaller = less latency (default 512, 0 = no sound)");
         printf("%s\n","EXAMPLES:");
         printf("%s\n","./chip8 -f./roms/keypad.ch8 -s1 -x10");
         printf("%s\n","[run keypad test (in ./roms/) with default speed, pixel size 10, and default keys]");
@@ -194,18 +887,111 @@ int main(int argc, char* argv[])
         return 0;    
     }
     printf("%s","chip8 main started\n");
-    printf("args: k = %d, s = %d, x = %d, file = %s\n", kflag, sval, xval, fval);
+#ifdef CHIP8_PROFILE
+    // kill -USR1 <pid> prints the opcode histogram while running
+    profile_install_signal();
+#endif
+    // emulation speed: --ips, or the nominal -s clock
+    // (0 = 10us, 1 = 100us, 2 = 1ms per instruction)
+    if (ips_val == 0)
+    {
+        switch (sval)
+        {
+        case 0:
+            ips_val = 100000;
+            break;
+        case 2:
+            ips_val = 1000;
+            break;
+        default:
+            ips_val = 10000;
+            break;
+        }
+    }
+    if (seed_flag == 0)
+    {
+        seed_val = (unsigned long)time(NULL);
+    }
+    printf("args: k = %d, s = %d, x = %d, ips = %lu, seed = %lu, file = %s\n", kflag, sval, xval, ips_val, seed_val, fval);
+
+    // check the ROM before starting anything (machines load it from the ROM cache)
+    if (fval == NULL)
+    {
+        printf("%s","no ROM given, use -f <file>\n");
+        return 1;
+    }
+    if (rom_load(fval) == NULL)
+    {
+        return 1;
+    }
+
+    if (wav_val != NULL && headless_flag == 0)
+    {
+        printf("%s","--wav needs --headless (windowed runs play sound on the audio device)\n");
+        return 1;
+    }
+    // replays run headless, with the seed and timer rate from the movie
+    if (replay_val != NULL)
+    {
+        return movie_replay(fval, replay_val, jit_flag == 1);
+    }
+    if (record_val != NULL && (headless_flag == 1 || load_state_val != NULL))
+    {
+        printf("%s","--record needs a windowed run from power-on (no --headless or --load-state)\n");
+        return 1;
+    }
+
+    // headless run: no threads, no SDL - the CPU runs flat out on this thread
+    if (headless_flag == 1)
+    {
+        headless_options opts = {};
+        opts.script = input_val;
+        opts.max_cycles = cycles_val;
+        // 60Hz timer tick in instructions
+        opts.tick_cycles = ips_val / SCHED_HZ;
+        opts.jit = jit_flag == 1;
+        opts.load_state = load_state_val;
+        opts.save_state = save_state_val;
+        // headless runs only record rewind history when asked (to measure it)
+        opts.rewind_bytes = rewind_val > 0 ? (unsigned long)rewind_val << 20 : 0;
+        opts.seed = seed_val;
+        opts.idle_skip = idle_skip_flag == 1;
+        opts.wav_file = wav_val;
+        return run_headless(fval, opts);
+    }
+    if (rewind_val < 0)
+    {
+        rewind_val = REWIND_DEFAULT_MB;
+    }
+    // window scaling: default pixel size (10, or 9 for scale3x), then the filter for it
+    if (xval == 0)
+    {
+        xval = filter_val == FILTER_SCALE3X ? 9 : 10;
+    }
+    if (!SDL_set_filter(xval, filter_val, scanlines_flag == 1))
+    {
+        return 1;
+    }
+
+    // frame hand-off between the cpu and render threads
+    triple_init(RENDER_FRAMES);
+    // key event queue from the input thread
+    key_ring_init(KEY_EVENTS);
 
-    // make cpu and input threads
+    // make cpu, input and render threads
+    // (the delay and sound timers need no thread - they are worked out from the clock on demand)
     std::thread cpu_thread_obj(cpu_thread);
     std::thread input_thread_obj(input_thread);
-    std::thread timer_thread_obj(timer_thread);
+    std::thread render_thread_obj(render_thread);
 
     // wait for threads to join
     cpu_thread_obj.join();
     input_thread_obj.join();
-    timer_thread_obj.join();
+    render_thread_obj.join();
     printf("%s","threads joined - exiting\n");
+#ifdef CHIP8_PROFILE
+    profile_dump(stdout);
+#endif
 
     return 0;
 }
\ No newline at end of file
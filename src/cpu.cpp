@@ -1,33 +1,11 @@
 #include "cpu.h"
-
-// define global variables
-// MEMORY: has 4kb (4096) bytes of RAM in 8bit segments
-// however, address 0x000 to 0x1FF are reserved - programs start at 0x200 (512)
-std::vector<unsigned char> RAM(4096);
-
-// STACK: origionally had only space 12 or 16 2-byte values
-// makeing this larger won't hurt anything
-std::vector<unsigned short> STACK(64);
-
-// 16 bit program counter
-unsigned short PC = 0;
-
-// 16 bit memory index register
-unsigned short IND = 0;
-
-// 16 bit stack pointer register
-unsigned short SP = 0;
-
-// 16 bit current opcode register
-unsigned short OPCODE = 0;
-
-// 16 8-bit general purpose variable registers
-// V0 - VF (0-15), VF is reserved as a flag register
-std::vector<unsigned char> VAR(16);
-
-// create a display of 64x32 pixels (64 wide, 32 tall)
-// use a 1 to show on, 0 to show off
-std::vector<std::vector<unsigned char>> display_matrix(32, std::vector<unsigned char>(64,0));
+#include "audio.h"
+#include "jit.h"
+#include "profile.h"
+#include "romcache.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // font table
 // this is the standard chip8 font table used by programs
@@ -49,213 +27,578 @@ std::vector<unsigned char> FONTS = {0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
 0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
 0xF0, 0x80, 0xF0, 0x80, 0x80}; // F
 
-// function to load fonts to memory
-int load_fonts()
+// SUPER-CHIP big font table (8x10 digits, FX30)
+// gets loaded in address 0x0A0 - 0x13F
+std::vector<unsigned char> BIG_FONTS = {0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0}; // F
+
+// handles the all zero opcode (unallocated memory) - stops the CPU
+int op_null(Chip8Machine &m, const Chip8Inst &in)
+{
+    printf("%s","ERROR: NULL OPCODE DETECTED\n");
+    return 1;
+}
+
+// PCG32 (O'Neill, pcg-random.org): 64-bit LCG state, permuted 32-bit output
+#define PCG_MULT 6364136223846793005ULL
+#define PCG_INC 1442695040888963407ULL
+
+static inline uint32_t pcg32_next(uint64_t &state)
+{
+    uint64_t old = state;
+    state = old * PCG_MULT + PCG_INC;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+void CPU_seed(Chip8Machine &m, uint64_t seed)
 {
-    // fonts are loaded from the font table to RAM
-    // address used: 0x050 to 0x09F
-    int mem_val = 80;
-    for(unsigned int i = 0; i < FONTS.size(); i++)
+    // standard PCG seeding: step, add the seed, step
+    m.rng = 0;
+    pcg32_next(m.rng);
+    m.rng = m.rng + seed;
+    pcg32_next(m.rng);
+}
+
+// function to generate random 8 bit number
+unsigned char random_val(Chip8Machine &m)
+{
+    // top bits of the output are the best mixed
+    return (unsigned char)(pcg32_next(m.rng) >> 24);
+}
+
+// display row helpers
+// a row is DISPLAY_WORDS words with word 0 = the left-most 64 pixels, so a
+// hi-res row is one 128-bit value; with SSE2 each row op is a single register
+// load, a few shifts/logic ops and a store (word 0 in the low lane)
+
+// XOR a sprite row (left = columns 0-63, right = columns 64-127) onto a display row
+// returns non-zero if the sprite erased a lit pixel
+static inline int row_xor(uint64_t *row, uint64_t left, uint64_t right)
+{
+#ifdef __SSE2__
+    __m128i r = _mm_load_si128((const __m128i *)row);
+    __m128i sprite = _mm_set_epi64x((long long)right, (long long)left);
+    __m128i hit = _mm_and_si128(r, sprite);
+    _mm_store_si128((__m128i *)row, _mm_xor_si128(r, sprite));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128())) != 0xFFFF;
+#else
+    int hit = ((row[0] & left) | (row[1] & right)) != 0;
+    row[0] = row[0] ^ left;
+    row[1] = row[1] ^ right;
+    return hit;
+#endif
+}
+
+// move every row n pixels right (0 < n < 64), pixels pushed off the edge are lost
+static void display_shift_right(display_buffer &d, int n)
+{
+    // lo-res rows only use word 0 - nothing may carry into word 1
+    uint64_t keep = d.hires ? ~(uint64_t)0 : 0;
+    int height = display_height(d);
+#ifdef __SSE2__
+    __m128i mask = _mm_set_epi64x((long long)keep, -1);
+    __m128i count = _mm_cvtsi32_si128(n);
+    __m128i carry = _mm_cvtsi32_si128(64 - n);
+    for (int y = 0; y < height; y++)
     {
-        RAM.at(mem_val) = FONTS.at(i);
-        mem_val = mem_val + 1;
+        __m128i r = _mm_load_si128((const __m128i *)d.rows[y]);
+        // both words shift at once, then word 0's low bits move up into word 1
+        __m128i out = _mm_or_si128(_mm_srl_epi64(r, count), _mm_sll_epi64(_mm_slli_si128(r, 8), carry));
+        _mm_store_si128((__m128i *)d.rows[y], _mm_and_si128(out, mask));
     }
+#else
+    for (int y = 0; y < height; y++)
+    {
+        d.rows[y][1] = ((d.rows[y][1] >> n) | (d.rows[y][0] << (64 - n))) & keep;
+        d.rows[y][0] = d.rows[y][0] >> n;
+    }
+#endif
+}
+
+// move every row n pixels left (0 < n < 64)
+static void display_shift_left(display_buffer &d, int n)
+{
+    int height = display_height(d);
+#ifdef __SSE2__
+    __m128i count = _mm_cvtsi32_si128(n);
+    __m128i carry = _mm_cvtsi32_si128(64 - n);
+    for (int y = 0; y < height; y++)
+    {
+        __m128i r = _mm_load_si128((const __m128i *)d.rows[y]);
+        __m128i out = _mm_or_si128(_mm_sll_epi64(r, count), _mm_srl_epi64(_mm_srli_si128(r, 8), carry));
+        _mm_store_si128((__m128i *)d.rows[y], out);
+    }
+#else
+    for (int y = 0; y < height; y++)
+    {
+        d.rows[y][0] = (d.rows[y][0] << n) | (d.rows[y][1] >> (64 - n));
+        d.rows[y][1] = d.rows[y][1] << n;
+    }
+#endif
+}
+
+// move the display down (n > 0) or up (n < 0) by whole rows, blanking the rows left behind
+static void display_shift_rows(display_buffer &d, int n)
+{
+    int height = display_height(d);
+    int rows = n < 0 ? -n : n;
+    if (rows > height)
+    {
+        rows = height;
+    }
+    if (n > 0)
+    {
+        memmove(d.rows[rows], d.rows[0], (height - rows) * sizeof(d.rows[0]));
+        memset(d.rows[0], 0, rows * sizeof(d.rows[0]));
+    }
+    else
+    {
+        memmove(d.rows[0], d.rows[rows], (height - rows) * sizeof(d.rows[0]));
+        memset(d.rows[height - rows], 0, rows * sizeof(d.rows[0]));
+    }
+}
+
+// 00E0 = clear screen
+int op_00E0(Chip8Machine &m, const Chip8Inst &in)
+{
+    // 64 packed 128-bit rows = one 1KB clear
+    memset(m.display.rows, 0, sizeof(m.display.rows));
+    m.io->clear_screen();
     return 0;
 }
 
-// function to load programs into program memory
-int load_program(std::string filename, unsigned int memVal)
+// scrolls work in pixels of the current mode (a lo-res scroll moves whole lo-res pixels)
+// the whole display is redrawn after one
+
+// 00CN = scroll the display down N rows
+int op_00CN(Chip8Machine &m, const Chip8Inst &in)
 {
-    // open the file:
-    int fileSize;
-    std::ifstream file(filename, std::ios::binary);
+    display_shift_rows(m.display, in.n);
+    m.io->draw_screen(m.display, DISPLAY_ALL_ROWS);
+    return 0;
+}
 
-    // get its size:
-    file.seekg(0, std::ios::end);
-    fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
+// 00DN = scroll the display up N rows
+int op_00DN(Chip8Machine &m, const Chip8Inst &in)
+{
+    display_shift_rows(m.display, -(int)in.n);
+    m.io->draw_screen(m.display, DISPLAY_ALL_ROWS);
+    return 0;
+}
 
-    // read the data:
-    unsigned char fileData[fileSize];
-    file.read((char*) &fileData[0], fileSize);
-    file.close();
+// 00FB = scroll the display right 4 pixels
+int op_00FB(Chip8Machine &m, const Chip8Inst &in)
+{
+    display_shift_right(m.display, 4);
+    m.io->draw_screen(m.display, DISPLAY_ALL_ROWS);
+    return 0;
+}
 
-    for(int i = 0; i < fileSize; i++)
-    {
-        RAM[memVal] = fileData[i];
-        memVal = memVal + 1;
-    }
+// 00FC = scroll the display left 4 pixels
+int op_00FC(Chip8Machine &m, const Chip8Inst &in)
+{
+    display_shift_left(m.display, 4);
+    m.io->draw_screen(m.display, DISPLAY_ALL_ROWS);
     return 0;
 }
 
-// function to generate random 8 bit number
-unsigned char random_val()
+// 00FD = exit the interpreter - stops the CPU
+int op_00FD(Chip8Machine &m, const Chip8Inst &in)
+{
+    printf("%s","0x00FD : program exited\n");
+    return 1;
+}
+
+// 00FE/00FF = lo-res/hi-res mode
+// switching modes clears the display
+int op_00FE(Chip8Machine &m, const Chip8Inst &in)
+{
+    memset(m.display.rows, 0, sizeof(m.display.rows));
+    m.display.hires = 0;
+    m.io->draw_screen(m.display, DISPLAY_ALL_ROWS);
+    return 0;
+}
+
+int op_00FF(Chip8Machine &m, const Chip8Inst &in)
+{
+    memset(m.display.rows, 0, sizeof(m.display.rows));
+    m.display.hires = 1;
+    m.io->draw_screen(m.display, DISPLAY_ALL_ROWS);
+    return 0;
+}
+
+// 00EE = return from subroutine
+int op_00EE(Chip8Machine &m, const Chip8Inst &in)
 {
-    unsigned int ranVal = (unsigned char) rand();
-    return ranVal;
+    // pop last PC from stack
+    m.PC = m.STACK[m.SP & STACK_MASK];
+    // decriment SP
+    m.SP = m.SP - 1;
+    return 0;
+}
+
+// 0NNN = execute machine language instruction
+int op_0NNN(Chip8Machine &m, const Chip8Inst &in)
+{
+    printf("%s","0x0NNN : ex ML inst - NOP\n");
+    return 0;
 }
 
 // function to handle opcode 0 instructions
 // 00E0 = clear screen
 // 0NNN = execute machine language instruction
 // 00EE = return from subroutine
-int op0()
+// 00CN/00DN/00FB/00FC = scroll, 00FD = exit, 00FE/00FF = lo-res/hi-res (SUPER-CHIP)
+int op0(Chip8Machine &m, const Chip8Inst &in)
 {
     // test if 0x00E0
-    if(OPCODE == 0x00E0)
+    if(in.opcode == 0x00E0)
     {
-        for(int i = 0; i < (int)display_matrix.size(); i++)
-        {
-            for(int j = 0; j < (int)display_matrix.at(i).size(); j++)
-            {
-                display_matrix.at(i).at(j) = 0;
-            }
-        }
-        clear_screen();
+        return op_00E0(m, in);
     }
     // test if 0x00EE
-    else if (OPCODE == 0x00EE)
+    else if (in.opcode == 0x00EE)
     {
-        // pop last PC from stack
-        PC = STACK[SP];
-        // decriment SP
-        SP = SP - 1;
+        return op_00EE(m, in);
     }
-    else
+    // SUPER-CHIP scroll and mode instructions
+    switch (in.opcode & 0xFFF0)
     {
-        printf("%s","0x0NNN : ex ML inst - NOP\n");
+    case 0x00C0:
+        return op_00CN(m, in);
+    case 0x00D0:
+        return op_00DN(m, in);
+    default:
+        break;
     }
-    return 0;
+    switch (in.opcode)
+    {
+    case 0x00FB:
+        return op_00FB(m, in);
+    case 0x00FC:
+        return op_00FC(m, in);
+    case 0x00FD:
+        return op_00FD(m, in);
+    case 0x00FE:
+        return op_00FE(m, in);
+    case 0x00FF:
+        return op_00FF(m, in);
+    default:
+        break;
+    }
+    return op_0NNN(m, in);
 }
 
 // function to handle opcode 1 instructions
 // 1NNN = jump to addr NNN
-int op1()
+int op1(Chip8Machine &m, const Chip8Inst &in)
 {
-    // get NNN value
-    // AND opcode with 00001111 11111111 (0x0FFF)
-    unsigned short tmp = (OPCODE & 0x0FFF);
+    // NNN comes predecoded
+    unsigned short tmp = in.nnn;
+    unsigned short from = m.PC - 2;
     // set program counter to tmp
-    PC = tmp;
+    m.PC = tmp;
+    // a short jump back may close a polling loop
+    if ((unsigned short)(from - tmp) <= 2 * (IDLE_MAX_BODY - 1) && m.idle_skip && from != m.idle_bad)
+    {
+        CPU_idle_check(m, from);
+    }
     return 0;
 }
 
 // function to handle opcode 2 instructions
 // 2NNN = call subroutine at NNN
-int op2()
+int op2(Chip8Machine &m, const Chip8Inst &in)
 {
     // incriment the stack pointer
-    SP = SP + 1;
+    m.SP = m.SP + 1;
     // push current PC onto the stack
-    STACK[SP] = PC;
-    // get NNN value
-    // AND opcode with 00001111 11111111 (0x0FFF)
-    unsigned short tmp = (OPCODE & 0x0FFF);
+    m.STACK[m.SP & STACK_MASK] = m.PC;
+    // NNN comes predecoded
+    unsigned short tmp = in.nnn;
     // set PC to tmp
-    PC = tmp;
+    m.PC = tmp;
     return 0;
 }
 
 // function to handle opcode 3 instructions
 // 3XNN = skip one 2-byte instruction if value in VX == NN
-int op3()
+int op3(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract X from opcode
-    // shift right 8, then AND with 0x000F
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract NN from opcode
-    unsigned char tmpn = (unsigned char)(OPCODE & 0x00FF);
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // NN comes predecoded
+    unsigned char tmpn = in.nn;
     // compare VX and NN
-    if (VAR[tmpx] == tmpn)
+    if (m.VAR[tmpx] == tmpn)
     {
         // if true, add 2 to PC to skip next instruction
-        PC = PC + 2;
+        m.PC = m.PC + 2;
     }
     return 0;
 }
 
 // function to handle opcode 4 instructions
 // 4XNN = skip one 2-byte instruction if value in VX != NN
-int op4()
+int op4(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract X from opcode
-    // shift right 8, then AND with 0x000F
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract NN from opcode
-    unsigned char tmpn = (unsigned char)(OPCODE & 0x00FF);
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // NN comes predecoded
+    unsigned char tmpn = in.nn;
     // compare VX and NN
-    if (VAR[tmpx] != tmpn)
+    if (m.VAR[tmpx] != tmpn)
     {
         // if true, add 2 to PC to skip next instruction
-        PC = PC + 2;
+        m.PC = m.PC + 2;
     }
     return 0;
 }
 
 // function to handle opcode 5 instructions
 // 5XY0 = skip one 2-byte instruction if value in VX == VY
-int op5()
-{
-    // extract X from opcode
-    // shift right 8, then AND with 0x000F
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract Y from opcode
-    // shift right 4, then AND with 0x000F
-    unsigned char tmpy = (unsigned char)((OPCODE >> 4) & 0x000F);
+int op5(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // Y comes predecoded
+    unsigned char tmpy = in.y;
     // compare VX and VY
-    if (VAR[tmpx] == VAR[tmpy])
+    if (m.VAR[tmpx] == m.VAR[tmpy])
     {
         // if true, add 2 to PC to skip next instruction
-        PC = PC + 2;
+        m.PC = m.PC + 2;
     }
     return 0;
 }
 
 // function to handle opcode 9 instructions
 // 9XY0 = skip one 2-byte instruction if value in VX != VY
-int op9()
-{
-    // extract X from opcode
-    // shift right 8, then AND with 0x000F
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract Y from opcode
-    // shift right 4, then AND with 0x000F
-    unsigned char tmpy = (unsigned char)((OPCODE >> 4) & 0x000F);
+int op9(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // Y comes predecoded
+    unsigned char tmpy = in.y;
     // compare VX and VY
-    if (VAR[tmpx] != VAR[tmpy])
+    if (m.VAR[tmpx] != m.VAR[tmpy])
     {
         // if true, add 2 to PC to skip next instruction
-        PC = PC + 2;
+        m.PC = m.PC + 2;
     }
     return 0;
 }
 
 // function to handle opcode 6 instructions
 // 6XNN = set register VX to NN
-int op6()
+int op6(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract X from opcode
-    // shift right 8, then AND with 0x000F
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract NN from opcode
-    unsigned char tmpn = (unsigned char)(OPCODE & 0x00FF);
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // NN comes predecoded
+    unsigned char tmpn = in.nn;
     // set VX to NN
-    VAR[tmpx] = tmpn;
+    m.VAR[tmpx] = tmpn;
     return 0;
 }
 
 // function to handle opcode 7 instructions
 // 7XNN = add NN to VX
 // NOTE: do not trigger an overflow flag or wrap-around
-int op7()
+int op7(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract X from opcode
-    // shift right 8, then AND with 0x000F
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract NN from opcode
-    unsigned char tmpn = (unsigned char)(OPCODE & 0x00FF);
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // NN comes predecoded
+    unsigned char tmpn = in.nn;
     // add, do not trigger overflow flag
-    VAR[tmpx] = VAR[tmpx] + tmpn;
+    m.VAR[tmpx] = m.VAR[tmpx] + tmpn;
+    return 0;
+}
+
+// ambious instruction toggle for 8XY6/8XYE
+// 1 = early chip8 behaviour (VX = VY before the shift), 0 = "modern" behaviour
+const int SHIFT_TOGGLE = 0;
+
+// 8XY0 = set VX with VY (VX = VY)
+int op_8XY0(Chip8Machine &m, const Chip8Inst &in)
+{
+    // set
+    m.VAR[in.x] = m.VAR[in.y];
+    return 0;
+}
+
+// 8XY1 = VX = VX OR VY (VY unaffected)
+int op_8XY1(Chip8Machine &m, const Chip8Inst &in)
+{
+    // OR
+    m.VAR[in.x] = (m.VAR[in.x] | m.VAR[in.y]);
+    return 0;
+}
+
+// 8XY2 = VX = VX AND VY (VY unaffected)
+int op_8XY2(Chip8Machine &m, const Chip8Inst &in)
+{
+    // AND
+    m.VAR[in.x] = (m.VAR[in.x] & m.VAR[in.y]);
+    return 0;
+}
+
+// 8XY3 = VX = VX XOR VY (VY unaffected)
+int op_8XY3(Chip8Machine &m, const Chip8Inst &in)
+{
+    // XOR
+    m.VAR[in.x] = (m.VAR[in.x] ^ m.VAR[in.y]);
+    return 0;
+}
+
+// 8XY4 = ADD: VX = VX + VY (VY unaffected)(does set/clear carry flag)
+int op_8XY4(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X and Y come predecoded
+    unsigned char tmpx = in.x;
+    unsigned char tmpy = in.y;
+    // ADD
+    // check for overflow
+    if (m.VAR[tmpx] + m.VAR[tmpy] >= 255)
+    {
+        m.VAR[tmpx] = m.VAR[tmpx] + m.VAR[tmpy];
+        // set VF register to signal overflow
+        m.VAR[15] = 1;
+    }
+    else
+    {
+        m.VAR[tmpx] = m.VAR[tmpx] + m.VAR[tmpy];
+        m.VAR[15] = 0;
+    }
+    return 0;
+}
+
+// 8XY5 = SUB: VX = VX - VY (does alter carry flag)
+int op_8XY5(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X and Y come predecoded
+    unsigned char tmpx = in.x;
+    unsigned char tmpy = in.y;
+    // VX = VX - VY
+    // if VX > VY, then VF is set to 1, otherwise 0
+    if (m.VAR[tmpx] > m.VAR[tmpy])
+    {
+        m.VAR[15] = 1;
+        m.VAR[tmpx] = (m.VAR[tmpx] - m.VAR[tmpy]);
+    }
+    else
+    {
+        m.VAR[15] = 0;
+        m.VAR[tmpx] = (m.VAR[tmpx] - m.VAR[tmpy]);
+    }
+    return 0;
+}
+
+// 8XY7 = SUB: VX = VY - VX (does alter carry flag)
+int op_8XY7(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X and Y come predecoded
+    unsigned char tmpx = in.x;
+    unsigned char tmpy = in.y;
+    // VX = VY - VX
+    // if VY > VX, then VF is set to 1, otherwise 0
+    if (m.VAR[tmpy] > m.VAR[tmpx])
+    {
+        m.VAR[15] = 1;
+        m.VAR[tmpx] = (m.VAR[tmpy] - m.VAR[tmpx]);
+    }
+    else
+    {
+        m.VAR[15] = 0;
+        m.VAR[tmpx] = (m.VAR[tmpy] - m.VAR[tmpx]);
+    }
+    return 0;
+}
+
+// 8XY6 = shift right: VX = VX >> 1 (does alter carry flag)
+int op_8XY6(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X and Y come predecoded
+    unsigned char tmpx = in.x;
+    unsigned char tmpy = in.y;
+    // VX = VX >> 1
+    // VF = shifted out bit
+    // first, check function toggle
+    if (SHIFT_TOGGLE)
+    {
+        // early chip8 would actually set VX to VY then shift
+        // VX = VY; VX = VX >> 1
+        // set VX to VY
+        m.VAR[tmpx] = m.VAR[tmpy];
+        // set VF to right-most bit
+        m.VAR[15] = m.VAR[tmpx] & 0x01;
+        // shift right 1
+        m.VAR[tmpx] = m.VAR[tmpx] >> 1;
+    }
+    else
+    {
+        // "modern" chip[8 implimentation
+        // VX = VX >> 1
+        // set VF to right-most bit
+        m.VAR[15] = m.VAR[tmpx] & 0x01;
+        // shift right 1
+        m.VAR[tmpx] = m.VAR[tmpx] >> 1;
+    }
+    return 0;
+}
+
+// 8XYE = shift left: VX = VX << 1 (does alter carry flag)
+int op_8XYE(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X and Y come predecoded
+    unsigned char tmpx = in.x;
+    unsigned char tmpy = in.y;
+    // VX = VX << 1
+    // VF = shifted out bit
+    // first, check function toggle
+    if (SHIFT_TOGGLE)
+    {
+        // early chip8 would actually set VX to VY then shift
+        // VX = VY; VX = VX << 1
+        // set VX to VY
+        m.VAR[tmpx] = m.VAR[tmpy];
+        // set VF to left-most bit
+        m.VAR[15] = m.VAR[tmpx] & 0x80;
+        // shift left 1
+        m.VAR[tmpx] = m.VAR[tmpx] << 1;
+    }
+    else
+    {
+        // "modern" chip[8 implimentation
+        // VX = VX >> 1
+        // set VF to left-most bit
+        m.VAR[15] = ((m.VAR[tmpx] & 0x80) >> 7);
+        // shift left 1
+        m.VAR[tmpx] = m.VAR[tmpx] << 1;
+    }
+    return 0;
+}
+
+// handles the unused 8XY? and FX?? variants - does nothing
+int op_nop(Chip8Machine &m, const Chip8Inst &in)
+{
     return 0;
 }
 
@@ -271,128 +614,29 @@ int op7()
 // 8XY6 = shift right: VX = VX >> 1 (does alter carry flag)
 // 8XYE = shift left: VX = VX << 1 (does alter carry flag)
 
-int op8()
+int op8(Chip8Machine &m, const Chip8Inst &in)
 {
-    // ambious instruction toggle
-    int toggle = 0;
-    // extract X from opcode
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract Y from opcode
-    unsigned char tmpy = (unsigned char)((OPCODE >> 4) & 0x000F);
-    // extract function flag
-    unsigned char tmpf = (unsigned char)(OPCODE & 0x000F);
-    // do function based on function flag
-    switch (tmpf)
+    // do function based on function flag (N comes predecoded)
+    switch (in.n)
     {
     case 0:
-        // set
-        VAR[tmpx] = VAR[tmpy];
-        break;
+        return op_8XY0(m, in);
     case 1:
-        // OR
-        VAR[tmpx] = (VAR[tmpx] | VAR[tmpy]);
-        break;
+        return op_8XY1(m, in);
     case 2:
-        // AND
-        VAR[tmpx] = (VAR[tmpx] & VAR[tmpy]);
-        break;
+        return op_8XY2(m, in);
     case 3:
-        // XOR
-        VAR[tmpx] = (VAR[tmpx] ^ VAR[tmpy]);
-        break;
+        return op_8XY3(m, in);
     case 4:
-        // ADD
-        // check for overflow
-        if (VAR[tmpx] + VAR[tmpy] >= 255)
-        {
-            VAR[tmpx] = VAR[tmpx] + VAR[tmpy];
-            // set VF register to signal overflow
-            VAR[15] = 1;
-        }
-        else
-        {
-            VAR[tmpx] = VAR[tmpx] + VAR[tmpy];
-            VAR[15] = 0;
-        }
-        break;
+        return op_8XY4(m, in);
     case 5:
-        // VX = VX - VY
-        // if VX > VY, then VF is set to 1, otherwise 0
-        if (VAR[tmpx] > VAR[tmpy])
-        {
-            VAR[15] = 1;
-            VAR[tmpx] = (VAR[tmpx] - VAR[tmpy]);
-        }
-        else
-        {
-            VAR[15] = 0;
-            VAR[tmpx] = (VAR[tmpx] - VAR[tmpy]);
-        }
-        break;
+        return op_8XY5(m, in);
     case 7:
-        // VX = VY - VX
-        // if VY > VX, then VF is set to 1, otherwise 0
-        if (VAR[tmpy] > VAR[tmpx])
-        {
-            VAR[15] = 1;
-            VAR[tmpx] = (VAR[tmpy] - VAR[tmpx]);
-        }
-        else
-        {
-            VAR[15] = 0;
-            VAR[tmpx] = (VAR[tmpy] - VAR[tmpx]);
-        }
-        break;
+        return op_8XY7(m, in);
     case 6:
-        // VX = VX >> 1
-        // VF = shifted out bit
-        // first, check function toggle
-        if (toggle)
-        {
-            // early chip8 would actually set VX to VY then shift
-            // VX = VY; VX = VX >> 1
-            // set VX to VY
-            VAR[tmpx] = VAR[tmpy];
-            // set VF to right-most bit
-            VAR[15] = VAR[tmpx] & 0x01;
-            // shift right 1
-            VAR[tmpx] = VAR[tmpx] >> 1;
-        }
-        else
-        {
-            // "modern" chip[8 implimentation
-            // VX = VX >> 1
-            // set VF to right-most bit
-            VAR[15] = VAR[tmpx] & 0x01;
-            // shift right 1
-            VAR[tmpx] = VAR[tmpx] >> 1;
-        }
-        break;
+        return op_8XY6(m, in);
     case 14:
-        // VX = VX << 1
-        // VF = shifted out bit
-        // first, check function toggle
-        if (toggle)
-        {
-            // early chip8 would actually set VX to VY then shift
-            // VX = VY; VX = VX << 1
-            // set VX to VY
-            VAR[tmpx] = VAR[tmpy];
-            // set VF to left-most bit
-            VAR[15] = VAR[tmpx] & 0x80;
-            // shift left 1
-            VAR[tmpx] = VAR[tmpx] << 1;
-        }
-        else
-        {
-            // "modern" chip[8 implimentation
-            // VX = VX >> 1
-            // set VF to left-most bit
-            VAR[15] = ((VAR[tmpx] & 0x80) >> 7);
-            // shift left 1
-            VAR[tmpx] = VAR[tmpx] << 1;
-        }
-        break;
+        return op_8XYE(m, in);
     default:
         break;
     }
@@ -401,12 +645,12 @@ int op8()
 
 // handle opcode A instructions
 // ANNN = set index register to NNN
-int op10()
+int op10(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract NNN from OPCODE
-    unsigned short tmpn = OPCODE & 0x0FFF;
+    // NNN comes predecoded
+    unsigned short tmpn = in.nnn;
     // set index to NNN
-    IND = tmpn;
+    m.IND = tmpn;
     return 0;
 }
 
@@ -415,32 +659,32 @@ int op10()
 // jump to NNN + value in V0 (used for jump table operations)
 // note: this command was handeled in a different manner in other chip implimentations
 // this is the most common method
-int op11()
+int op11(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract NNN from OPCODE
-    unsigned short tmpn = OPCODE & 0x0FFF;
+    // NNN comes predecoded
+    unsigned short tmpn = in.nnn;
     // add V0 to tmpn;
-    tmpn = tmpn + VAR[0];
+    tmpn = tmpn + m.VAR[0];
     // jump to tmpn
-    PC = tmpn;
+    m.PC = tmpn;
     return 0;
 }
 
 // handle opcode C instructions
 // CXNN = generates a random number, binary ANDs it with the value NN
 // store in VX
-int op12()
+int op12(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract NN from OPCODE
-    unsigned char tmpn = (unsigned char)OPCODE & 0x00FF;
-    // extract VX
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
+    // NN comes predecoded
+    unsigned char tmpn = in.nn;
+    // X comes predecoded
+    unsigned char tmpx = in.x;
     // get random numper
-    unsigned char tmpr = random_val();
+    unsigned char tmpr = random_val(m);
     // AND with NN
     tmpr = tmpr & tmpn;
     // set VX
-    VAR[tmpx] = tmpr;
+    m.VAR[tmpx] = tmpr;
     return 0;
 }
 
@@ -449,95 +693,263 @@ int op12()
 // N = number of pixels tall, starting at memory pointed to by I register
 // X = starting X coordinate
 // Y = starting Y coordinate
-int op13()
-{
-    // extract X from opcode
-    unsigned char tmpx = (unsigned char)VAR[((OPCODE >> 8) & 0x000F)] % 64;
-    // extract Y from opcode
-    unsigned char tmpy = (unsigned char)VAR[((OPCODE >> 4) & 0x000F)] % 32;
-    // extract N
-    unsigned char tmpn = (unsigned char)(OPCODE & 0x000F);
-    // temp variable to store pixel data and count
-    unsigned char tmpp = 0;
-    unsigned char pxl = 0;
+int op13(Chip8Machine &m, const Chip8Inst &in)
+{
+    int width = display_width(m.display);
+    int height = display_height(m.display);
+    // X comes predecoded (both widths are powers of 2, so % is a mask)
+    unsigned int tmpx = m.VAR[in.x] & (width - 1);
+    // Y comes predecoded
+    unsigned int tmpy = m.VAR[in.y] & (height - 1);
+    // N comes predecoded, N = 0 draws a 16x16 sprite (2 bytes per row)
+    unsigned int tmpn = in.n;
+    unsigned int wide = 0;
+    if (tmpn == 0)
+    {
+        tmpn = 16;
+        wide = 1;
+    }
+    // lo-res rows only use word 0 - sprite bits past column 63 fall off
+    uint64_t keep = m.display.hires ? ~(uint64_t)0 : 0;
+    // next sprite byte
+    unsigned short addr = m.IND;
+    // rows the sprite touched, so the backend only redraws those
+    uint64_t dirty = 0;
     // initial pixel colide state is zero
-    VAR[15] = 0;
-    // loop through N number of bytes, if N = 0 stop
+    m.VAR[15] = 0;
+    // lo-res 8 wide sprites (all of plain CHIP-8) only ever touch word 0
+    if (keep == 0 && wide == 0)
+    {
+        for (unsigned int i = 0; i < tmpn && tmpy < (unsigned int)height; i++)
+        {
+            uint64_t tmpp = ((uint64_t)m.RAM[(addr + i) & RAM_MASK] << 56) >> tmpx;
+            if (m.display.rows[tmpy][0] & tmpp)
+            {
+                m.VAR[15] = 1;
+            }
+            m.display.rows[tmpy][0] = m.display.rows[tmpy][0] ^ tmpp;
+            dirty = dirty | ((uint64_t)1 << tmpy);
+            tmpy = tmpy+1;
+        }
+        m.io->draw_screen(m.display, dirty);
+        return 0;
+    }
+    // loop through N rows
     // dont wrap around bottom of screen
     for (unsigned int i = 0; i < tmpn; i++)
     {
         // test if overflow Y
-        if (tmpy > 31)
+        if (tmpy >= (unsigned int)height)
         {
-            //printf("%s","display overflow Y\n");
             break;
         }
-        // get pixel data
-        tmpp = RAM[IND+i];
-        // loop through pixel data
-        for (unsigned int j = 0; j < 8; j++)
+        // sprite row in the top bits of a word
+        uint64_t tmpp = (uint64_t)m.RAM[addr & RAM_MASK] << 56;
+        if (wide)
         {
-            // test if overflow X
-            if (tmpx+j > 63)
-            {
-                //printf("%s","display overflow X\n");
-                break;
-            }
-            // extract data from pixel byte
-            pxl = ((tmpp << j) & 0x80) >> 7;
-            // set pixel data to screen
-            if (pxl == 1)
-            {
-                // if 1
-                if (display_matrix.at(tmpy).at(tmpx+j) == 1)
-                {
-                    display_matrix.at(tmpy).at(tmpx+j) = 0; // erased
-                    // set VF to 1
-                    VAR[15] = 1;
-                }
-                else
-                {
-                    display_matrix.at(tmpy).at(tmpx+j) = 1;
-                }
-            }
+            tmpp = tmpp | (uint64_t)m.RAM[(addr + 1) & RAM_MASK] << 48;
+        }
+        addr = addr + 1 + wide;
+        // line the sprite row up with the 128-bit row at column X in one shift
+        // bits shifted past the right edge fall off (no wrap around)
+        unsigned __int128 line = ((unsigned __int128)tmpp << 64) >> tmpx;
+        // XOR the whole sprite row onto the screen at once
+        // any sprite pixel landing on a lit pixel erases it - set VF to 1
+        if (row_xor(m.display.rows[tmpy], (uint64_t)(line >> 64), (uint64_t)line & keep))
+        {
+            m.VAR[15] = 1;
         }
+        dirty = dirty | ((uint64_t)1 << tmpy);
         tmpy = tmpy+1;
     }
     // draw the screen
-    draw_screen_vector(display_matrix);
+    m.io->draw_screen(m.display, dirty);
+    return 0;
+}
+
+// EXA1 = skip one instruction if the key value in X is not pressed (0)
+int op_EXA1(Chip8Machine &m, const Chip8Inst &in)
+{
+    // value in VX (X comes predecoded)
+    unsigned char tmpx = (unsigned char)m.VAR[in.x];
+    // EXA1 - skip if not pressed
+    // check if not pressed
+    if (m.KEYS[tmpx & 0x0F] == 0)
+    {
+        // checks if key input register (keys) at the value in X is 0
+        // ex: if VX = 15, checks if F is 0
+        m.PC = m.PC + 2; // skip next instruction
+    }
+    return 0;
+}
+
+// EX9E = skip one instruction if the key value in X is pressed (1)
+int op_EX9E(Chip8Machine &m, const Chip8Inst &in)
+{
+    // value in VX (X comes predecoded)
+    unsigned char tmpx = (unsigned char)m.VAR[in.x];
+    // EX9E - skip if pressed
+    // check if not pressed
+    if (m.KEYS[tmpx & 0x0F] == 1)
+    {
+        m.PC = m.PC + 2; // skip next instruction
+    }
     return 0;
 }
 
 // handle opcode E instructions
 // EX9E = skip one instruction if the key value in X is pressed (1)
 // EXA1 = skip one instruction if the key value in X is not pressed (0)
-int op14(std::vector<unsigned char> &keys)
+int op14(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract value from X from opcode
-    unsigned char tmpx = (unsigned char)VAR[((OPCODE >> 8) & 0x000F)];
-    // extract toggle from opcode
-    unsigned char tmpt = (unsigned char)OPCODE & 0x000F;
+    // toggle (N) comes predecoded
+    if (in.n == 1)
+    {
+        return op_EXA1(m, in);
+    }
+    return op_EX9E(m, in);
+}
 
-    if (tmpt == 1)
+// FX07 = sets VAR X to the current value of the delay timer
+int op_FX07(Chip8Machine &m, const Chip8Inst &in)
+{
+    // set X to current value in delay timer
+    m.VAR[in.x] = CPU_get_delay(m);
+    return 0;
+}
+
+// FX15 = sets the delay timer to the value in X
+int op_FX15(Chip8Machine &m, const Chip8Inst &in)
+{
+    // set delay timer to value in X
+    CPU_set_delay(m, m.VAR[in.x]);
+    return 0;
+}
+
+// FX18 = sets the sound timer to the value in X
+int op_FX18(Chip8Machine &m, const Chip8Inst &in)
+{
+    // set sound timer to value in X
+    CPU_set_sound(m, m.VAR[in.x]);
+    return 0;
+}
+
+// FX1E = adds the value in X to the index register
+int op_FX1E(Chip8Machine &m, const Chip8Inst &in)
+{
+    // add value in X to IND
+    // if above 1000 (outside the normal addressing range), set F to 1
+    m.IND = m.IND + m.VAR[in.x];
+    if (m.IND > 0x0FFF)
     {
-        // EXA1 - skip if not pressed
-        // check if not pressed
-        if (keys.at(tmpx) == 0)
-        {
-            // checks if key input register (keys) at the value in X is 0
-            // ex: if VX = 15, checks if F is 0
-            PC = PC + 2; // skip next instruction
-        }
+        m.VAR[15] = 1;
     }
-    else
+    return 0;
+}
+
+// FX0A = blocks until a key is pressed, and puts key value into X
+int op_FX0A(Chip8Machine &m, const Chip8Inst &in)
+{
+    // lowest pressed key goes into X (key 0 counts)
+    for (unsigned int i = 0; i < 16; i++)
     {
-        // EX9E - skip if pressed
-        // check if not pressed
-        if (keys.at(tmpx) == 1)
+        if (m.KEYS[i] == 1)
         {
-            PC = PC + 2; // skip next instruction
+            m.VAR[in.x] = i;
+            m.key_wait = false;
+            return 0;
         }
     }
+    // no key - stay on this instruction (blocking call)
+    m.PC = m.PC - 2;
+    m.key_wait = true;
+    // keys only change between runs, so every retry until the end of this one
+    // would find none too - let those cycles pass at once
+    if (m.idle_skip && m.run_end > m.cycles)
+    {
+        m.idle_skipped = m.idle_skipped + (m.run_end - m.cycles);
+        m.cycles = m.run_end;
+    }
+    return 0;
+}
+
+// FX29 = point to font character X
+int op_FX29(Chip8Machine &m, const Chip8Inst &in)
+{
+    // index register = address of hex font in X
+    // only uses last nibble in X
+    // font starts at 0x50 and each is 5 bytes long
+    m.IND = 0x50 + (5*(m.VAR[in.x] & 0x0F));
+    return 0;
+}
+
+// FX30 = point to big font character X
+int op_FX30(Chip8Machine &m, const Chip8Inst &in)
+{
+    // big font starts at 0xA0 and each is 10 bytes long
+    m.IND = BIG_FONT_START + (10*(m.VAR[in.x] & 0x0F));
+    return 0;
+}
+
+// FX33 = BCD operation
+int op_FX33(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // BCD conversion
+    // number in X is split into 100s, 10s, and 1s stored in IND-IND+2
+    // ex: VAR[x] = 123
+    // IND = 1
+    // IND + 1 = 2
+    // IND + 2 = 3
+    m.RAM[(m.IND + 0) & RAM_MASK] = ((m.VAR[tmpx] / 100) % 10);
+    m.RAM[(m.IND + 1) & RAM_MASK] = ((m.VAR[tmpx] / 10) % 10);
+    m.RAM[(m.IND + 2) & RAM_MASK] = (m.VAR[tmpx] % 10);
+    invalidate_decode(m, m.IND, 3);
+    return 0;
+}
+
+// FX55 = store memory
+int op_FX55(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // store all registers in memory
+    // dont change IND, use a temp variable
+    for (unsigned int i = 0; i <= (unsigned int)tmpx; i++)
+    {
+        // iterate through VAR, and save to RAM at IND + i
+        m.RAM[(m.IND+i) & RAM_MASK] = m.VAR[i];
+    }
+    invalidate_decode(m, m.IND, tmpx + 1);
+    return 0;
+}
+
+// FX65 = load memory
+int op_FX65(Chip8Machine &m, const Chip8Inst &in)
+{
+    // X comes predecoded
+    unsigned char tmpx = in.x;
+    // load all registers in memory
+    for (unsigned int i = 0; i <= (unsigned int)tmpx; i++)
+    {
+        // iterate through VAR, and save RAM at IND + i to VAR
+        m.VAR[i] = m.RAM[(m.IND+i) & RAM_MASK];
+    }
+    return 0;
+}
+
+// FX75 = store V0 - VX in the RPL flags
+int op_FX75(Chip8Machine &m, const Chip8Inst &in)
+{
+    memcpy(m.RPL, m.VAR, in.x + 1);
+    return 0;
+}
+
+// FX85 = load V0 - VX from the RPL flags
+int op_FX85(Chip8Machine &m, const Chip8Inst &in)
+{
+    memcpy(m.VAR, m.RPL, in.x + 1);
     return 0;
 }
 
@@ -551,204 +963,607 @@ int op14(std::vector<unsigned char> &keys)
 // FX33 = BCD operation (see code)
 // FX55 = store memory
 // FX65 = load memory
-int op15(std::vector<unsigned char> &keys, unsigned char &DEL_TIME, unsigned char &SOUND_TIME)
+// FX30 = point to big font character X (SUPER-CHIP)
+// FX75/FX85 = store/load RPL flags (SUPER-CHIP)
+int op15(Chip8Machine &m, const Chip8Inst &in)
 {
-    // extract X from opcode
-    unsigned char tmpx = (unsigned char)((OPCODE >> 8) & 0x000F);
-    // extract toggle from opcode
-    unsigned short tmpt = (unsigned short)OPCODE & 0x00FF;
-    // temp variable for key press
-    unsigned int pressed = 0;
-
-    // case statement to select specific instruction
-    switch (tmpt)
+    // case statement to select specific instruction (NN comes predecoded)
+    switch (in.nn)
     {
     case 0x07:
-        // set X to current value in delay timer
-        VAR[tmpx] = DEL_TIME;
-        break;
+        return op_FX07(m, in);
     case 0x15:
-        // set delay timer to value in X
-        DEL_TIME = VAR[tmpx];
-        break;
+        return op_FX15(m, in);
     case 0x18:
-        // set sound timer to value in X
-        SOUND_TIME = VAR[tmpx];
-        break;
+        return op_FX18(m, in);
     case 0x1E:
-        // add value in X to IND
-        // if above 1000 (outside the normal addressing range), set F to 1
-        IND = IND + VAR[tmpx];
-        if (IND > 0x0FFF)
-        {
-            VAR[15] = 1;
-        }
-        break;
+        return op_FX1E(m, in);
     case 0x0A:
-        // loop through keys, if one is pressed (1) stop and set to X
-        // else set PC to PC - 2 (blocking call)
-        for (unsigned int i = 0; i < (unsigned int)keys.size(); i++)
-        {
-            if (keys.at(i) == 1)
-            {
-                pressed = i;
-                break;
-            }
-        }
-        if (pressed > 0)
-        {
-            // key pressed - set X to key
-            VAR[tmpx] = pressed;
-        }
-        else
-        {
-            // dec PC
-            PC = PC -2;
-        }
-        break;
+        return op_FX0A(m, in);
     case 0x29:
-        // index register = address of hex font in X
-        // only uses last nibble in X
-        // font starts at 0x50 and each is 5 bytes long
-        IND = 0x50 + (5*(VAR[tmpx] & 0x0F));
-        break;
+        return op_FX29(m, in);
     case 0x33:
-        // BCD conversion
-        // number in X is split into 100s, 10s, and 1s stored in IND-IND+2
-        // ex: VAR[x] = 123
-        // IND = 1
-        // IND + 1 = 2
-        // IND + 2 = 3
-        RAM[IND + 0] = ((VAR[tmpx] / 100) % 10);
-        RAM[IND + 1] = ((VAR[tmpx] / 10) % 10);
-        RAM[IND + 2] = (VAR[tmpx] % 10);
-        break;
+        return op_FX33(m, in);
     case 0x55:
-        // store all registers in memory
-        // dont change IND, use a temp variable
-        for (unsigned int i = 0; i <= (unsigned int)tmpx; i++)
-        {
-            // iterate through VAR, and save to RAM at IND + i
-            RAM[IND+i] = VAR[i];
-        }
-        break;
+        return op_FX55(m, in);
     case 0x65:
-        // load all registers in memory
-        for (unsigned int i = 0; i <= (unsigned int)tmpx; i++)
-        {
-            // iterate through VAR, and save RAM at IND + i to VAR
-            VAR[i] = RAM[IND+i];
-        }
-        break;
+        return op_FX65(m, in);
+    case 0x30:
+        return op_FX30(m, in);
+    case 0x75:
+        return op_FX75(m, in);
+    case 0x85:
+        return op_FX85(m, in);
     default:
         break;
     }
     return 0;
 }
 
-int init_CPU(int &xval, char* fval)
+int init_CPU(Chip8Machine &m, int &xval, char* fval, const io_backend *io)
 {
-    // load font into memory
-    load_fonts();
-    printf("%s","Loaded fonts into memory\n");
-    // load program into memory
-    load_program(fval, 512);
-    //load_program("bc_test.ch8", 512);
-    printf("%s","Loaded program into memory\n");
+    // a recompiler's blocks belong to the old RAM, so it is freed (call jit_init
+    // again to keep recompiling); the sound ring is not the machine's and stays attached
+    jit_close(m);
+    audio_ring *audio = m.audio;
+    // reset the machine and select the display backend
+    memset(&m, 0, sizeof(m));
+    m.io = io;
+    m.audio = audio;
+    // fonts and program come as one prepared RAM image (read once per ROM)
+    const rom_image *rom = rom_load(fval);
+    if (rom == NULL)
+    {
+        return 1;
+    }
+    memcpy(m.RAM, rom->ram, RAM_SIZE);
+    printf("Loaded program into memory (%u bytes)\n", rom->size);
     // init the screen
-    SDL_screen_init(xval);
+    m.io->screen_init(xval);
 
     // set PC to program start
-    PC = 512;
+    m.PC = ROM_START;
+
+    // timers default to the virtual clock at 10000 instructions/s
+    CPU_set_clock(m, TIMER_VIRTUAL, 10000 / TIMER_HZ);
 
-    // initialize random seed
-    srand (time(NULL));
+    // seed the random number generator from the time (--seed, or a later CPU_seed, overrides it)
+    CPU_seed(m, time(NULL));
+    m.idle_skip = true;
     return 0;
 }
 
-int CPU_cycle(std::vector<unsigned char> &keys, unsigned char &DEL_TIME, unsigned char &SOUND_TIME)
+// handler table indexed by the first opcode nibble
+// 0 = clear screen, subroutine return, or a NOP
+// 1 = jump
+// 2 = subroutine call
+// 3/4/5/9 = various skip instruction functions
+// 6 = set function
+// 7 = add function
+// 8 = register atrithmatic/logical functions
+// A = set index (10)
+// B = jump with offset (11)
+// C = random number gen (12)
+// D = display (13)
+// E = skip if key press (14)
+// F = timer/index add/get key/font char/BCD conversion/load and store memory (15)
+op_handler OP_TABLE[16] = {op0, op1, op2, op3, op4, op5, op6, op7,
+    op8, op9, op10, op11, op12, op13, op14, op15};
+
+// work out the full opcode variant of a raw opcode
+unsigned char decode_variant(unsigned short opcode)
 {
-    // fetch instruction (16 bit from 2 8-bit memory locations)
-    OPCODE = (RAM[PC] << 8) | RAM[PC+1];
-    // incriment PC by 2
-    PC = PC + 2;
-    // decode instruction
-    // instructions are broken up by opcode and operand
-    // get first nibble for opcode, save as op
-    unsigned char op = OPCODE >> 12;
-    //printf("%x\n",OPCODE);
-    // execute instructions
-    // switch statment to call different functions based on the opcode
-    // 0 = clear screen, subroutine return, or a NOP
-    // 1 = jump
-    // 2 = subroutine call
-    // 3/4/5/9 = various skip instruction functions
-    // 6 = set function
-    // 7 = add function
-    // 8 = register atrithmatic/logical functions
-    // A = set index (10)
-    // B = jump with offset (11)
-    // C = random number gen (12)
-    // D = display (13)
-    // E = skip if key press (14)
-    // F = timer/index add/get key/font char/BCD conversion/load and store memory (15)
-    switch (op)
+    // variants for 8XY0 - 8XYF, by function flag
+    static const unsigned char VARIANTS_8[16] = {V_8XY0, V_8XY1, V_8XY2, V_8XY3,
+        V_8XY4, V_8XY5, V_8XY6, V_8XY7, V_NOP, V_NOP, V_NOP, V_NOP, V_NOP, V_NOP, V_8XYE, V_NOP};
+    switch (opcode >> 12)
     {
     case 0:
-        if (OPCODE == 0) // check for all zero opcode = unallocated memory
+        if (opcode == 0)
         {
-            printf("%s","ERROR: NULL OPCODE DETECTED\n");
-            return 1;
+            return V_NULL;
         }
-        op0();
-        break;
+        if (opcode == 0x00E0)
+        {
+            return V_00E0;
+        }
+        if (opcode == 0x00EE)
+        {
+            return V_00EE;
+        }
+        switch (opcode & 0xFFF0)
+        {
+        case 0x00C0:
+            return V_00CN;
+        case 0x00D0:
+            return V_00DN;
+        default:
+            break;
+        }
+        switch (opcode)
+        {
+        case 0x00FB:
+            return V_00FB;
+        case 0x00FC:
+            return V_00FC;
+        case 0x00FD:
+            return V_00FD;
+        case 0x00FE:
+            return V_00FE;
+        case 0x00FF:
+            return V_00FF;
+        default:
+            break;
+        }
+        return V_0NNN;
     case 1:
-        op1();
-        break;
+        return V_1NNN;
     case 2:
-        op2();
-        break;
+        return V_2NNN;
     case 3:
-        op3();
-        break;
+        return V_3XNN;
     case 4:
-        op4();
-        break;
+        return V_4XNN;
     case 5:
-        op5();
-        break;
+        return V_5XY0;
     case 6:
-        op6();
-        break;
+        return V_6XNN;
     case 7:
-        op7();
-        break;
+        return V_7XNN;
     case 8:
-        op8();
-        break;
+        return VARIANTS_8[opcode & 0x000F];
     case 9:
-        op9();
-        break;
+        return V_9XY0;
     case 10:
-        op10();
-        break;
+        return V_ANNN;
     case 11:
-        op11();
-        break;
+        return V_BNNN;
     case 12:
-        op12();
-        break;
+        return V_CXNN;
     case 13:
-        op13();
-        break;
+        return V_DXYN;
     case 14:
-        op14(keys);
-        break;
-    case 15:
-        op15(keys, DEL_TIME, SOUND_TIME);
+        // same test as op14 - anything but EXA1 is treated as EX9E
+        return (opcode & 0x000F) == 1 ? V_EXA1 : V_EX9E;
+    default:
         break;
+    }
+    // opcode F
+    switch (opcode & 0x00FF)
+    {
+    case 0x07:
+        return V_FX07;
+    case 0x0A:
+        return V_FX0A;
+    case 0x15:
+        return V_FX15;
+    case 0x18:
+        return V_FX18;
+    case 0x1E:
+        return V_FX1E;
+    case 0x29:
+        return V_FX29;
+    case 0x33:
+        return V_FX33;
+    case 0x55:
+        return V_FX55;
+    case 0x65:
+        return V_FX65;
+    case 0x30:
+        return V_FX30;
+    case 0x75:
+        return V_FX75;
+    case 0x85:
+        return V_FX85;
     default:
         break;
     }
+    return V_NOP;
+}
+
+// decode the instruction at addr into the machine's decode cache
+Chip8Inst &decode_inst(Chip8Machine &m, unsigned short addr)
+{
+    Chip8Inst &in = m.DCACHE[addr & RAM_MASK];
+    // fetch instruction (16 bit from 2 8-bit memory locations)
+    in.opcode = (m.RAM[addr & RAM_MASK] << 8) | m.RAM[(addr+1) & RAM_MASK];
+    // instructions are broken up by opcode and operand
+    // pull every operand field out once, here, instead of in each handler
+    in.x = (in.opcode >> 8) & 0x000F;
+    in.y = (in.opcode >> 4) & 0x000F;
+    in.n = in.opcode & 0x000F;
+    in.nn = in.opcode & 0x00FF;
+    in.nnn = in.opcode & 0x0FFF;
+    in.variant = decode_variant(in.opcode);
+    // all zero opcode = unallocated memory
+    if (in.opcode == 0)
+    {
+        in.handler = op_null;
+    }
+    else
+    {
+        in.handler = OP_TABLE[in.opcode >> 12];
+    }
+    return in;
+}
+
+// invalidate the decode cache entries covering a RAM write of len bytes at addr
+void invalidate_decode(Chip8Machine &m, unsigned short addr, unsigned int len)
+{
+    // the instruction starting one byte before addr also covers it
+    for (unsigned int i = 0; i <= len; i++)
+    {
+        m.DCACHE[(addr - 1 + i) & RAM_MASK].handler = NULL;
+        m.DCACHE[(addr - 1 + i) & RAM_MASK].variant = V_NONE;
+    }
+    m.idle_bad = 0;
+    if (m.jit != NULL)
+    {
+        jit_invalidate(m, addr, len);
+    }
+}
+
+// invalidate the whole decode cache
+void invalidate_decode_all(Chip8Machine &m)
+{
+    for (unsigned int i = 0; i < RAM_SIZE; i++)
+    {
+        m.DCACHE[i].handler = NULL;
+        m.DCACHE[i].variant = V_NONE;
+    }
+    m.idle_bad = 0;
+    if (m.jit != NULL)
+    {
+        jit_invalidate_all(m);
+    }
+}
+
+int CPU_cycle(Chip8Machine &m)
+{
+    // fetch the predecoded instruction at PC, decoding it on a miss
+    Chip8Inst *in = &m.DCACHE[m.PC & RAM_MASK];
+    if (in->handler == NULL)
+    {
+        in = &decode_inst(m, m.PC);
+    }
+    m.OPCODE = in->opcode;
+    // incriment PC by 2
+    m.PC = m.PC + 2;
+    m.cycles = m.cycles + 1;
+    // execute instruction (counted and timed when profiling)
+    PROFILE_COUNT(in->variant);
+    int status;
+    PROFILE_CALL(in->opcode >> 12, status = in->handler(m, *in));
+    return status;
+}
+
+// CLOCK_MONOTONIC now in ns
+unsigned long monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+// select the timer clock domain and restart it at tick 0
+void CPU_set_clock(Chip8Machine &m, unsigned int clock, unsigned long tick_cycles)
+{
+    // carry the running timers over to the new clock
+    unsigned char del = CPU_get_delay(m);
+    unsigned char sound = CPU_get_sound(m);
+    m.timer_clock = clock;
+    m.tick_cycles = tick_cycles > 0 ? tick_cycles : 1;
+    m.wall_base = monotonic_ns();
+    CPU_set_delay(m, del);
+    CPU_set_sound(m, sound);
+}
+
+// current tick of the machine's timer clock
+unsigned long CPU_timer_ticks(const Chip8Machine &m)
+{
+    if (m.timer_clock == TIMER_WALL)
+    {
+        // ns * 60 / 1e9
+        return ((monotonic_ns() - m.wall_base) * 3) / 50000000UL;
+    }
+    // cycles already counts the current instruction
+    return m.cycles > 0 ? (m.cycles - 1) / m.tick_cycles : 0;
+}
+
+// ns from tick 0 to the start of a tick (1e9 / 60 per tick)
+static unsigned long tick_ns(unsigned long tick)
+{
+    return tick * 50000000UL / 3;
+}
+
+unsigned long CPU_timer_ns(const Chip8Machine &m)
+{
+    if (m.timer_clock == TIMER_WALL)
+    {
+        return monotonic_ns();
+    }
+    // whole ticks, plus the part of this one already run
+    unsigned long done = m.cycles > 0 ? m.cycles - 1 : 0;
+    return tick_ns(done / m.tick_cycles) + (done % m.tick_cycles) * 50000000UL / (3 * m.tick_cycles);
+}
+
+// timer value latched at stamp, after counting down to now (stops at 0)
+unsigned char timer_value(unsigned char latched, unsigned long stamp, unsigned long now)
+{
+    unsigned long elapsed = now - stamp;
+    return elapsed >= latched ? 0 : latched - elapsed;
+}
+
+unsigned char CPU_get_delay(const Chip8Machine &m)
+{
+    return timer_value(m.DEL_TIME, m.del_stamp, CPU_timer_ticks(m));
+}
+
+unsigned char CPU_get_sound(const Chip8Machine &m)
+{
+    return timer_value(m.SOUND_TIME, m.sound_stamp, CPU_timer_ticks(m));
+}
+
+void CPU_set_delay(Chip8Machine &m, unsigned char val)
+{
+    m.DEL_TIME = val;
+    m.del_stamp = CPU_timer_ticks(m);
+}
+
+// queue the sound timer's tone, from now until the timer runs out
+static void post_tone(Chip8Machine &m)
+{
+    unsigned long now = CPU_timer_ns(m);
+    unsigned long stop = tick_ns(m.sound_stamp + m.SOUND_TIME);
+    if (m.timer_clock == TIMER_WALL)
+    {
+        stop = stop + m.wall_base;
+    }
+    else if (m.audio->realtime)
+    {
+        // emulated time played live: the tone starts now and lasts as long in real time
+        unsigned long wall = monotonic_ns();
+        stop = stop - now + wall;
+        now = wall;
+    }
+    audio_post(*m.audio, now, stop);
+}
+
+void CPU_set_sound(Chip8Machine &m, unsigned char val)
+{
+    m.SOUND_TIME = val;
+    m.sound_stamp = CPU_timer_ticks(m);
+    if (m.audio != NULL)
+    {
+        post_tone(m);
+    }
+}
+
+// instructions a polling loop may contain: they only read the registers, the
+// keys and the delay timer, and write V registers or I
+static bool idle_safe(unsigned char variant)
+{
+    switch (variant)
+    {
+    case V_3XNN: case V_4XNN: case V_5XY0: case V_9XY0:
+    case V_6XNN: case V_7XNN:
+    case V_8XY0: case V_8XY1: case V_8XY2: case V_8XY3: case V_8XY4: case V_8XY5: case V_8XY6: case V_8XY7:
+    case V_8XYE:
+    case V_ANNN: case V_EX9E: case V_EXA1:
+    case V_FX07: case V_FX1E: case V_FX29: case V_FX30:
+    case V_NOP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void CPU_idle_check(Chip8Machine &m, unsigned short from)
+{
+    unsigned short head = m.PC;
+    // skips move by whole instructions, so an odd distance never comes back here
+    const Chip8Inst &jump = m.DCACHE[from & RAM_MASK];
+    if (((from - head) & 1) != 0 || jump.variant != V_1NNN || jump.nnn != head)
+    {
+        return;
+    }
+    // only instructions without side effects (not decoded = never run, which we can't vouch for)
+    for (unsigned short addr = head; addr != from; addr = addr + 2)
+    {
+        if (!idle_safe(m.DCACHE[addr & RAM_MASK].variant))
+        {
+            m.idle_bad = from;
+            return;
+        }
+    }
+    // cheap first test: the registers are the same as at the last jump back here, on the same tick
+    unsigned long tick = CPU_timer_ticks(m);
+    bool same = m.idle_head == head && m.idle_tick == tick && m.IND == m.idle_ind &&
+        memcmp(m.VAR, m.idle_var, sizeof(m.VAR)) == 0;
+    m.idle_head = head;
+    m.idle_ind = m.IND;
+    m.idle_tick = tick;
+    memcpy(m.idle_var, m.VAR, sizeof(m.VAR));
+    if (!same)
+    {
+        return;
+    }
+    // the way back may have left the loop (a skip over the jump), so make sure:
+    // run one pass from the head on the current registers, keys and timer value
+    // (these handlers only touch V, I and PC) and see that it comes back to the
+    // jump inside the loop with nothing changed
+    unsigned long pass = 1;
+    while (m.PC != from)
+    {
+        if ((unsigned short)(m.PC - head) > (unsigned short)(from - head))
+        {
+            break;
+        }
+        const Chip8Inst &in = m.DCACHE[m.PC & RAM_MASK];
+        m.PC = m.PC + 2;
+        in.handler(m, in);
+        pass = pass + 1;
+    }
+    same = m.PC == from && m.IND == m.idle_ind && memcmp(m.VAR, m.idle_var, sizeof(m.VAR)) == 0;
+    m.PC = head;
+    m.IND = m.idle_ind;
+    memcpy(m.VAR, m.idle_var, sizeof(m.VAR));
+    if (!same)
+    {
+        return;
+    }
+    // every pass up to the next tick or the end of the run is the same one - move
+    // cycles on by whole passes
+    unsigned long limit = m.run_end;
+    if (m.timer_clock == TIMER_VIRTUAL && (tick + 1) * m.tick_cycles < limit)
+    {
+        limit = (tick + 1) * m.tick_cycles;
+    }
+    else if (m.timer_clock == TIMER_WALL)
+    {
+        // the wall clock ticks whatever the cycle count is: skip no further than
+        // the instructions the nominal rate (tick_cycles per tick) runs before the
+        // next wall tick, so a loop polling the delay timer sees it change on time
+        unsigned long next = m.wall_base + tick_ns(tick + 1);
+        unsigned long now = monotonic_ns();
+        unsigned long until = next > now ? m.cycles + (next - now) * 3 * m.tick_cycles / 50000000UL : m.cycles;
+        if (until < limit)
+        {
+            limit = until;
+        }
+    }
+    if (limit > m.cycles)
+    {
+        unsigned long skip = (limit - m.cycles) / pass * pass;
+        m.cycles = m.cycles + skip;
+        m.idle_skipped = m.idle_skipped + skip;
+    }
+}
+
+#ifdef CHIP8_THREADED_DISPATCH
+// threaded dispatch: every instruction ends by fetching the next decode cache
+// entry and jumping straight to the code for its variant, so there is no
+// per-instruction loop, switch or second-level decode
+int CPU_run(Chip8Machine &m, unsigned long end_cycle)
+{
+    // idle loops are only skipped up to the end of the run
+    m.run_end = end_cycle;
+    // set again if this run ends on an FX0A with no key (a state load may have
+    // left it from a machine that was waiting)
+    m.key_wait = false;
+    if (m.jit != NULL)
+    {
+        return jit_run(m, end_cycle);
+    }
+    // one label per op_variant, in enum order
+    static void *const LABELS[V_COUNT] = {
+        &&l_none, &&l_null,
+        &&l_00E0, &&l_00EE, &&l_0NNN,
+        &&l_00CN, &&l_00DN, &&l_00FB, &&l_00FC, &&l_00FD, &&l_00FE, &&l_00FF,
+        &&l_1NNN, &&l_2NNN, &&l_3XNN, &&l_4XNN, &&l_5XY0, &&l_6XNN, &&l_7XNN,
+        &&l_8XY0, &&l_8XY1, &&l_8XY2, &&l_8XY3, &&l_8XY4, &&l_8XY5, &&l_8XY6, &&l_8XY7, &&l_8XYE,
+        &&l_9XY0, &&l_ANNN, &&l_BNNN, &&l_CXNN, &&l_DXYN,
+        &&l_EX9E, &&l_EXA1,
+        &&l_FX07, &&l_FX0A, &&l_FX15, &&l_FX18, &&l_FX1E, &&l_FX29, &&l_FX33, &&l_FX55, &&l_FX65,
+        &&l_FX30, &&l_FX75, &&l_FX85,
+        &&l_nop};
+    Chip8Inst *in;
+    int status = 0;
+
+// fetch the next instruction and jump to it (same steps as CPU_cycle)
+#define DISPATCH() \
+    do { \
+        if (m.cycles >= end_cycle) { return 0; } \
+        in = &m.DCACHE[m.PC & RAM_MASK]; \
+        m.OPCODE = in->opcode; \
+        m.PC = m.PC + 2; \
+        m.cycles = m.cycles + 1; \
+        goto *LABELS[in->variant]; \
+    } while (0)
+// run a handler that never stops the CPU, then go on to the next instruction
+#define NEXT(fn) PROFILE_COUNT(in->variant); PROFILE_CALL(in->opcode >> 12, fn(m, *in)); DISPATCH()
+// run a handler that may stop the CPU
+#define CHECK(fn) PROFILE_COUNT(in->variant); PROFILE_CALL(in->opcode >> 12, status = fn(m, *in)); \
+    if (status != 0) { return status; } DISPATCH()
+
+    DISPATCH();
+l_none:
+    // decode cache miss - decode and jump to the instruction's variant
+    in = &decode_inst(m, m.PC - 2);
+    m.OPCODE = in->opcode;
+    goto *LABELS[in->variant];
+l_null:  CHECK(op_null);
+l_00E0:  NEXT(op_00E0);
+l_00EE:  NEXT(op_00EE);
+l_0NNN:  NEXT(op_0NNN);
+l_00CN:  NEXT(op_00CN);
+l_00DN:  NEXT(op_00DN);
+l_00FB:  NEXT(op_00FB);
+l_00FC:  NEXT(op_00FC);
+l_00FD:  CHECK(op_00FD);
+l_00FE:  NEXT(op_00FE);
+l_00FF:  NEXT(op_00FF);
+l_1NNN:  NEXT(op1);
+l_2NNN:  NEXT(op2);
+l_3XNN:  NEXT(op3);
+l_4XNN:  NEXT(op4);
+l_5XY0:  NEXT(op5);
+l_6XNN:  NEXT(op6);
+l_7XNN:  NEXT(op7);
+l_8XY0:  NEXT(op_8XY0);
+l_8XY1:  NEXT(op_8XY1);
+l_8XY2:  NEXT(op_8XY2);
+l_8XY3:  NEXT(op_8XY3);
+l_8XY4:  NEXT(op_8XY4);
+l_8XY5:  NEXT(op_8XY5);
+l_8XY6:  NEXT(op_8XY6);
+l_8XY7:  NEXT(op_8XY7);
+l_8XYE:  NEXT(op_8XYE);
+l_9XY0:  NEXT(op9);
+l_ANNN:  NEXT(op10);
+l_BNNN:  NEXT(op11);
+l_CXNN:  NEXT(op12);
+l_DXYN:  NEXT(op13);
+l_EX9E:  NEXT(op_EX9E);
+l_EXA1:  NEXT(op_EXA1);
+l_FX07:  NEXT(op_FX07);
+l_FX0A:  NEXT(op_FX0A);
+l_FX15:  NEXT(op_FX15);
+l_FX18:  NEXT(op_FX18);
+l_FX1E:  NEXT(op_FX1E);
+l_FX29:  NEXT(op_FX29);
+l_FX33:  NEXT(op_FX33);
+l_FX55:  NEXT(op_FX55);
+l_FX65:  NEXT(op_FX65);
+l_FX30:  NEXT(op_FX30);
+l_FX75:  NEXT(op_FX75);
+l_FX85:  NEXT(op_FX85);
+l_nop:   NEXT(op_nop);
+
+#undef CHECK
+#undef NEXT
+#undef DISPATCH
+}
+#else
+int CPU_run(Chip8Machine &m, unsigned long end_cycle)
+{
+    // idle loops are only skipped up to the end of the run
+    m.run_end = end_cycle;
+    // set again if this run ends on an FX0A with no key (a state load may have
+    // left it from a machine that was waiting)
+    m.key_wait = false;
+    if (m.jit != NULL)
+    {
+        return jit_run(m, end_cycle);
+    }
+    while (m.cycles < end_cycle)
+    {
+        int status = CPU_cycle(m);
+        if (status != 0)
+        {
+            return status;
+        }
+    }
     return 0;
 }
+#endif
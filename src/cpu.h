@@ -1,65 +1,292 @@
 // CPU program to handle the chip8 cpu
+#ifndef CPU_H
+#define CPU_H
 
 // includes
 #include <vector>
+#include <string>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
-#include "iohandle.h"
+#include <time.h>
+#include <string.h>
+#include "iobackend.h"
 
-// function to init the cpu
-int init_CPU(int &xval, char* fval);
+// MEMORY: has 4kb (4096) bytes of RAM in 8bit segments
+// addresses are masked into range so a bad index can't leave the machine
+#define RAM_SIZE 4096
+#define RAM_MASK 0x0FFF
+
+// STACK: origionally had only space 12 or 16 2-byte values
+// makeing this larger won't hurt anything (must stay a power of 2)
+#define STACK_SIZE 64
+#define STACK_MASK (STACK_SIZE - 1)
+
+// FONTS: the built-in hex digit sprites live at 0x050 - 0x09F
+#define FONT_START 80
+extern std::vector<unsigned char> FONTS;
+// SUPER-CHIP 8x10 digit sprites (FX30) follow at 0x0A0 - 0x13F
+#define BIG_FONT_START 160
+extern std::vector<unsigned char> BIG_FONTS;
+
+// SUPER-CHIP RPL user flags saved and loaded by FX75/FX85
+#define RPL_FLAGS 16
+
+// TIMERS: the delay and sound timers count down at 60Hz on a clock domain
+// virtual = one tick every tick_cycles instructions (exact and reproducible)
+// wall = one tick every 1/60th of a second of real time
+#define TIMER_VIRTUAL 0
+#define TIMER_WALL 1
+#define TIMER_HZ 60
+
+// IDLE LOOPS: a backward jump over at most this many instructions is checked
+// for a side-effect-free polling loop (see CPU_idle_check)
+#define IDLE_MAX_BODY 8
+
+struct Chip8Machine;
+struct Chip8Inst;
+struct jit_state;
+struct audio_ring;
+
+// instruction handler: runs one decoded instruction on a machine
+// returns 0 to keep going, non-zero to stop the CPU
+typedef int (*op_handler)(Chip8Machine &m, const Chip8Inst &in);
+
+// full opcode variants, one per distinct instruction
+// used by the threaded dispatcher to jump straight to an instruction's code
+// without going through the per-nibble handlers (V_NONE = not decoded yet)
+enum op_variant
+{
+    V_NONE = 0,
+    V_NULL,
+    V_00E0, V_00EE, V_0NNN,
+    // SUPER-CHIP: scroll down/up N, scroll right/left 4, exit, lo-res, hi-res
+    V_00CN, V_00DN, V_00FB, V_00FC, V_00FD, V_00FE, V_00FF,
+    V_1NNN, V_2NNN, V_3XNN, V_4XNN, V_5XY0, V_6XNN, V_7XNN,
+    V_8XY0, V_8XY1, V_8XY2, V_8XY3, V_8XY4, V_8XY5, V_8XY6, V_8XY7, V_8XYE,
+    V_9XY0, V_ANNN, V_BNNN, V_CXNN, V_DXYN,
+    V_EX9E, V_EXA1,
+    V_FX07, V_FX0A, V_FX15, V_FX18, V_FX1E, V_FX29, V_FX33, V_FX55, V_FX65,
+    V_FX30, V_FX75, V_FX85,
+    // unused 8XY? and FX?? encodings - do nothing
+    V_NOP,
+    V_COUNT
+};
+
+// predecoded instruction
+// the decode cache holds one of these per RAM address, so an instruction's
+// handler and operand fields are only worked out once
+struct Chip8Inst
+{
+    // handler for the instruction (NULL = not decoded yet)
+    op_handler handler;
+    // raw 16 bit opcode
+    unsigned short opcode;
+    // NNN = low 12 bits (address)
+    unsigned short nnn;
+    // X = second nibble, Y = third nibble, N = low nibble, NN = low byte
+    unsigned char x;
+    unsigned char y;
+    unsigned char n;
+    unsigned char nn;
+    // full opcode variant (op_variant)
+    unsigned char variant;
+};
+
+// chip8 machine state
+// one instance holds everything an emulated machine needs in fixed-size
+// contiguous storage, so many machines can run side by side in one process
+// the hot registers are packed into the first cache line, followed by the stack,
+// RAM, the display and the decode cache
+struct alignas(64) Chip8Machine
+{
+    // 16 bit program counter
+    unsigned short PC;
+    // 16 bit memory index register
+    unsigned short IND;
+    // 16 bit stack pointer register
+    unsigned short SP;
+    // 16 bit current opcode register
+    unsigned short OPCODE;
+    // instructions executed since init (counts the current instruction)
+    unsigned long cycles;
+    // 8 bit delay timer, as last set by FX15 (read it with CPU_get_delay)
+    unsigned char DEL_TIME;
+    // 8-bit sound timer, as last set by FX18 (read it with CPU_get_sound)
+    unsigned char SOUND_TIME;
+    // 16 8-bit general purpose variable registers
+    // V0 - VF (0-15), VF is reserved as a flag register
+    unsigned char VAR[16];
+    // keypad state, 1 = pressed (written by the input side, read by EX9E/EXA1/FX0A)
+    unsigned char KEYS[16];
+    // the last CPU_run ended on an FX0A that found no key (the CPU is waiting on one)
+    bool key_wait;
+    // display backend the machine draws through
+    const io_backend *io;
+    // recompiler state (NULL unless jit_init was called)
+    jit_state *jit;
+    // sound timer tones go here (NULL = no sound output)
+    audio_ring *audio;
+    // timer clock ticks when DEL_TIME and SOUND_TIME were set
+    // the timers are never counted down - their value is derived from these on demand
+    unsigned long del_stamp;
+    unsigned long sound_stamp;
+    // timer clock domain (TIMER_VIRTUAL or TIMER_WALL)
+    unsigned int timer_clock;
+    // instructions per tick (virtual clock)
+    unsigned long tick_cycles;
+    // CLOCK_MONOTONIC ns at tick 0 (wall clock)
+    unsigned long wall_base;
+    // random number generator state (PCG32, see CPU_seed)
+    uint64_t rng;
+    // SUPER-CHIP RPL user flags (FX75/FX85)
+    unsigned char RPL[RPL_FLAGS];
+    // idle loop skipping: on/off, end_cycle of the current CPU_run, and the
+    // loop head, tick and registers seen on the last short backward jump
+    bool idle_skip;
+    unsigned long run_end;
+    unsigned short idle_head;
+    unsigned short idle_ind;
+    // jump closing the last loop found to have side effects (callers don't
+    // check it again until code is rewritten)
+    unsigned short idle_bad;
+    unsigned long idle_tick;
+    unsigned char idle_var[16];
+    // instructions skipped in idle loops
+    unsigned long idle_skipped;
+    // call stack
+    unsigned short STACK[STACK_SIZE];
+    // program and font memory
+    // address 0x000 to 0x1FF are reserved - programs start at 0x200 (512)
+    unsigned char RAM[RAM_SIZE];
+    // display of 64x32 pixels, or 128x64 in SUPER-CHIP hi-res mode
+    // packed 128-bit rows, bit set = pixel on (see DISPLAY_ROW_PIXEL)
+    display_buffer display;
+    // decode cache, indexed by address
+    // entries are invalidated when RAM under them is written (FX33, FX55, state loads)
+    Chip8Inst DCACHE[RAM_SIZE];
+};
+
+// function to reset a machine and init the cpu
+// io is the display backend (RENDER_IO for a window, NULL_IO for headless runs)
+// m must be zeroed or a machine init_CPU set up before: an attached recompiler
+// is freed, an attached sound ring is kept
+// the ROM comes from the ROM cache (romcache.h); returns non-zero if it can't be loaded
+int init_CPU(Chip8Machine &m, int &xval, char* fval, const io_backend *io);
 
 // perform a single fetch-decode-ex CPU cycle
-int CPU_cycle(std::vector<unsigned char> &keys, unsigned char &DEL_TIME, unsigned char &SOUND_TIME);
+int CPU_cycle(Chip8Machine &m);
+
+// run CPU cycles until the machine has executed end_cycle instructions in total
+// uses the recompiler when one is attached
+// built with CHIP8_THREADED_DISPATCH, the interpreter runs instructions back to
+// back through a computed-goto table indexed by opcode variant instead of CPU_cycle
+// returns the first non-zero handler status (e.g. a NULL opcode) or 0
+int CPU_run(Chip8Machine &m, unsigned long end_cycle);
 
-// function to load fonts to memory
-int load_fonts();
+// called after a backward jump from the instruction at from to a loop head at PC
+// a polling loop (only register, skip, key and delay timer reads) whose pass
+// leaves the registers as they were will make the same pass until the delay
+// timer ticks or the keys change (only between runs), so cycles is moved on by
+// whole passes up to the next tick or the end of the run (on the wall clock, up to
+// the instructions the nominal rate runs before the next wall tick)
+// the skipped passes would have changed nothing else, so results are identical
+void CPU_idle_check(Chip8Machine &m, unsigned short from);
 
-// function to load programs into program memory
-int load_program(std::string filename, unsigned int memVal);
+// select the timer clock domain (TIMER_VIRTUAL or TIMER_WALL) and restart it at tick 0
+// tick_cycles is the instructions per tick on the virtual clock
+// running timers keep their current values
+void CPU_set_clock(Chip8Machine &m, unsigned int clock, unsigned long tick_cycles);
 
-// function to generate random 8 bit number
-unsigned char random_val();
+// current tick of the machine's timer clock
+// (virtual: ticks completed before the current instruction started)
+unsigned long CPU_timer_ticks(const Chip8Machine &m);
+
+// current time on the machine's timer clock in ns (wall: CLOCK_MONOTONIC,
+// virtual: emulated time since cycle 0, at the start of the current instruction)
+unsigned long CPU_timer_ns(const Chip8Machine &m);
+
+// current delay/sound timer values, worked out from the latched value and the clock
+unsigned char CPU_get_delay(const Chip8Machine &m);
+unsigned char CPU_get_sound(const Chip8Machine &m);
+
+// latch new delay/sound timer values at the current tick
+// a new sound timer value is also posted to m.audio as a tone from now until it runs out
+void CPU_set_delay(Chip8Machine &m, unsigned char val);
+void CPU_set_sound(Chip8Machine &m, unsigned char val);
+
+// seed the machine's random number generator (CXNN)
+// each machine has its own generator, so machines in one process don't share
+// (or lock) a sequence, and the same seed always gives the same run
+void CPU_seed(Chip8Machine &m, uint64_t seed);
+
+// decode the instruction at addr into the machine's decode cache
+Chip8Inst &decode_inst(Chip8Machine &m, unsigned short addr);
+
+// invalidate the decode cache entries covering a RAM write of len bytes at addr
+void invalidate_decode(Chip8Machine &m, unsigned short addr, unsigned int len);
+
+// invalidate the whole decode cache
+void invalidate_decode_all(Chip8Machine &m);
+
+// handles the all zero opcode (unallocated memory) - stops the CPU
+int op_null(Chip8Machine &m, const Chip8Inst &in);
+
+// handles the unused 8XY? and FX?? variants - does nothing
+int op_nop(Chip8Machine &m, const Chip8Inst &in);
+
+// work out the full opcode variant (op_variant) of a raw opcode
+unsigned char decode_variant(unsigned short opcode);
+
+// next random 8 bit number from the machine's generator (CXNN)
+unsigned char random_val(Chip8Machine &m);
 
 // function to handle opcode 0 instructions
 // 00E0 = clear screen
 // 0NNN = execute machine language instruction
 // 00EE = return from subroutine
-int op0();
+// SUPER-CHIP:
+// 00CN = scroll the display down N rows
+// 00DN = scroll the display up N rows (XO-CHIP)
+// 00FB = scroll the display right 4 pixels
+// 00FC = scroll the display left 4 pixels
+// 00FD = exit the interpreter (stops the CPU)
+// 00FE = lo-res mode (64x32), clears the display
+// 00FF = hi-res mode (128x64), clears the display
+int op0(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 1 instructions
 // 1NNN = jump to addr NNN
-int op1();
+int op1(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 2 instructions
 // 2NNN = call subroutine at NNN
-int op2();
+int op2(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 3 instructions
 // 3XNN = skip one 2-byte instruction if value in VX == NN
-int op3();
+int op3(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 4 instructions
 // 4XNN = skip one 2-byte instruction if value in VX != NN
-int op4();
+int op4(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 5 instructions
 // 5XY0 = skip one 2-byte instruction if value in VX == VY
-int op5();
+int op5(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 9 instructions
 // 9XY0 = skip one 2-byte instruction if value in VX != VY
-int op9();
+int op9(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 6 instructions
 // 6XNN = set register VX to NN
-int op6();
+int op6(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 7 instructions
 // 7XNN = add NN to VX
 // NOTE: do not trigger an overflow flag or wrap-around
-int op7();
+int op7(Chip8Machine &m, const Chip8Inst &in);
 
 // function to handle opcode 8 instructions
 // 8XYF = F function flag as shown below
@@ -72,35 +299,36 @@ int op7();
 // 8XY7 = SUB: VX = VY - VX (does alter carry flag)
 // 8XY6 = shift right: VX = VX >> 1 (does alter carry flag)
 // 8XYE = shift left: VX = VX << 1 (does alter carry flag)
-int op8();
+int op8(Chip8Machine &m, const Chip8Inst &in);
 
 // handle opcode A instructions
 // ANNN = set index register to NNN
-int op10();
+int op10(Chip8Machine &m, const Chip8Inst &in);
 
 // handle opcode B instructions
 // BNNN = jump with offset
 // jump to NNN + value in V0 (used for jump table operations)
 // note: this command was handeled in a different manner in other chip implimentations
 // this is the most common method
-int op11();
+int op11(Chip8Machine &m, const Chip8Inst &in);
 
 // handle opcode C instructions
 // CXNN = generates a random number, binary ANDs it with the value NN
 // store in VX
-int op12();
+int op12(Chip8Machine &m, const Chip8Inst &in);
 
 // handle opcode D instructions
 // DXYN = display sprite:
 // N = number of pixels tall, starting at memory pointed to by I register
 // X = starting X coordinate
 // Y = starting Y coordinate
-int op13();
+// DXY0 = 16x16 sprite, 2 bytes per row (SUPER-CHIP)
+int op13(Chip8Machine &m, const Chip8Inst &in);
 
 // handle opcode E instructions
 // EX9E = skip one instruction if the key value in X is pressed (1)
 // EXA1 = skip one instruction if the key value in X is not pressed (0)
-int op14(std::vector<unsigned char> &keys);
+int op14(Chip8Machine &m, const Chip8Inst &in);
 
 // handle opcode F instructions
 // FX07 = sets VAR X to the current value of the delay timer
@@ -108,8 +336,14 @@ int op14(std::vector<unsigned char> &keys);
 // FX18 = sets the sound timer to the value in X
 // FX1E = adds the value in X to the index register
 // FX0A = blocks until a key is pressed, and puts key value into X
+//        (while none is, the rest of the run passes at once and key_wait is set)
 // FX29 = point to font character X
 // FX33 = BCD operation (see code)
 // FX55 = store memory
 // FX65 = load memory
-int op15(std::vector<unsigned char> &keys, unsigned char &DEL_TIME, unsigned char &SOUND_TIME);
+// FX30 = point to big font character X (SUPER-CHIP)
+// FX75 = store V0 - VX in the RPL flags (SUPER-CHIP)
+// FX85 = load V0 - VX from the RPL flags (SUPER-CHIP)
+int op15(Chip8Machine &m, const Chip8Inst &in);
+
+#endif
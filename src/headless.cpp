@@ -0,0 +1,253 @@
+// headless runner: null display backend plus scripted input
+#include <stdio.h>
+#include <time.h>
+#include "headless.h"
+#include "jit.h"
+#include "profile.h"
+#include "savestate.h"
+
+// null backend functions
+bool null_screen_init(int &xval)
+{
+    return true;
+}
+
+void null_screen_close()
+{
+}
+
+int null_clear_screen()
+{
+    return 0;
+}
+
+int null_draw_screen(const display_buffer &screen, uint64_t dirty_rows)
+{
+    return 0;
+}
+
+// null display backend - every call is a no-op
+const io_backend NULL_IO = {null_screen_init, null_screen_close, null_clear_screen, null_draw_screen};
+
+// load an input script into memory
+int load_input_script(input_script &script, const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("ERROR: could not open input script %s\n", filename);
+        return 1;
+    }
+    script.events.clear();
+    script.pos = 0;
+    char line[128];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_num = line_num + 1;
+        // skip comments and blank lines
+        char first = 0;
+        sscanf(line, " %c", &first);
+        if (first == 0 || first == '#')
+        {
+            continue;
+        }
+        unsigned long cycle;
+        unsigned int key;
+        unsigned int state;
+        if (sscanf(line, "%lu %x %u", &cycle, &key, &state) != 3 || key > 15 || state > 1)
+        {
+            printf("ERROR: bad input script line %d: %s", line_num, line);
+            fclose(file);
+            return 1;
+        }
+        if (!script.events.empty() && cycle < script.events.back().cycle)
+        {
+            printf("ERROR: input script line %d is out of cycle order\n", line_num);
+            fclose(file);
+            return 1;
+        }
+        script.events.push_back({cycle, (unsigned char)key, (unsigned char)state});
+    }
+    fclose(file);
+    printf("Loaded %d input events\n", (int)script.events.size());
+    return 0;
+}
+
+// apply every scripted event due at or before the given cycle to the machine's keypad
+void apply_input_script(input_script &script, unsigned long cycle, Chip8Machine &m)
+{
+    while (script.pos < script.events.size() && script.events[script.pos].cycle <= cycle)
+    {
+        m.KEYS[script.events[script.pos].key] = script.events[script.pos].state;
+        script.pos = script.pos + 1;
+    }
+}
+
+unsigned long headless_checksum(const Chip8Machine &m)
+{
+    unsigned long sum = 14695981039346656037UL;
+    // the pixels of the current mode (a lo-res display sums as it always has)
+    int height = display_height(m.display);
+    int width = display_width(m.display);
+    for (int i = 0; i < height; i++)
+    {
+        for (int j = 0; j < width; j++)
+        {
+            sum = (sum ^ DISPLAY_ROW_PIXEL(m.display.rows[i], j)) * 1099511628211UL;
+        }
+    }
+    for (int i = 0; i < RAM_SIZE; i++)
+    {
+        sum = (sum ^ m.RAM[i]) * 1099511628211UL;
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        sum = (sum ^ m.VAR[i]) * 1099511628211UL;
+    }
+    sum = (sum ^ m.PC) * 1099511628211UL;
+    sum = (sum ^ m.IND) * 1099511628211UL;
+    return sum;
+}
+
+// run an initialised machine headless, applying scripted input with timers on the virtual clock
+int run_machine_headless(Chip8Machine &m, input_script &events, unsigned long max_cycles, unsigned long tick_cycles,
+    rewind_buffer *rewind, wav_writer *wav)
+{
+    if (wav != NULL)
+    {
+        m.audio = &wav->player.ring;
+    }
+    // timers tick every tick_cycles instructions
+    CPU_set_clock(m, TIMER_VIRTUAL, tick_cycles);
+    tick_cycles = m.tick_cycles;
+    if (wav != NULL)
+    {
+        // the file starts where the run does (a restored state is not at 0)
+        audio_start(wav->player, CPU_timer_ns(m));
+    }
+    while (max_cycles == 0 || m.cycles < max_cycles)
+    {
+        apply_input_script(events, m.cycles, m);
+        // run in bursts up to the next timer tick (so SIGUSR1 is seen), scripted input event or the cycle limit
+        unsigned long end_cycle = (m.cycles / tick_cycles + 1) * tick_cycles;
+        if (events.pos < events.events.size() && events.events[events.pos].cycle < end_cycle)
+        {
+            end_cycle = events.events[events.pos].cycle;
+        }
+        if (max_cycles != 0 && max_cycles < end_cycle)
+        {
+            end_cycle = max_cycles;
+        }
+        int status = CPU_run(m, end_cycle);
+        if (wav != NULL)
+        {
+            // every tone up to here has been posted
+            wav_write(*wav, CPU_timer_ns(m));
+        }
+        if (status != 0)
+        {
+            return 1;
+        }
+        if (rewind != NULL && m.cycles % tick_cycles == 0)
+        {
+            rewind_push(*rewind, m);
+        }
+        PROFILE_POLL();
+    }
+    return 0;
+}
+
+// library entry point: run a ROM headless
+int run_headless(char* fval, const headless_options &opts)
+{
+    // each run owns its machine and input script, so runs can share a process
+    input_script events = {};
+    int xval = 0;
+
+    if (opts.script != NULL && load_input_script(events, opts.script) != 0)
+    {
+        return 1;
+    }
+    Chip8Machine *m = new Chip8Machine();
+    if (init_CPU(*m, xval, fval, &NULL_IO) != 0)
+    {
+        delete m;
+        return 1;
+    }
+    CPU_seed(*m, opts.seed);
+    m->idle_skip = opts.idle_skip;
+
+    if (opts.jit)
+    {
+        jit_init(*m);
+    }
+    if (opts.load_state != NULL && snapshot_load(*m, opts.load_state) != 0)
+    {
+        jit_close(*m);
+        delete m;
+        return 1;
+    }
+    // skip input events from before the restored cycle
+    apply_input_script(events, m->cycles, *m);
+
+    rewind_buffer *rewind = NULL;
+    if (opts.rewind_bytes > 0)
+    {
+        rewind = new rewind_buffer();
+        if (rewind_init(*rewind, opts.rewind_bytes) != 0)
+        {
+            delete rewind;
+            rewind = NULL;
+        }
+    }
+
+    wav_writer *wav = NULL;
+    if (opts.wav_file != NULL)
+    {
+        wav = new wav_writer();
+        if (wav_open(*wav, opts.wav_file) != 0)
+        {
+            delete wav;
+            wav = NULL;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_machine_headless(*m, events, opts.max_cycles, opts.tick_cycles, rewind, wav);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("headless run finished: %lu cycles in %.3f s (%.0f cycles/s)\n", m->cycles, secs, secs > 0 ? m->cycles / secs : 0.0);
+    printf("final state checksum: %016lx\n", headless_checksum(*m));
+    if (m->idle_skipped > 0)
+    {
+        printf("idle loops: %lu of %lu instructions skipped (%.1f%%)\n", m->idle_skipped, m->cycles,
+            100.0 * m->idle_skipped / m->cycles);
+    }
+#ifdef CHIP8_PROFILE
+    profile_dump(stdout);
+#endif
+    if (rewind != NULL)
+    {
+        rewind_report(*rewind);
+        rewind_close(*rewind);
+        delete rewind;
+    }
+    if (wav != NULL)
+    {
+        printf("sound: %.2f s written to %s\n", (double)wav->samples / wav->player.rate, opts.wav_file);
+        if (wav_close(*wav) != 0)
+        {
+            status = 1;
+        }
+        delete wav;
+    }
+    if (opts.save_state != NULL && snapshot_save(*m, opts.save_state) != 0)
+    {
+        status = 1;
+    }
+    jit_close(*m);
+    delete m;
+    return status;
+}
@@ -0,0 +1,78 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// headless runner: null display backend plus scripted input
+// lets the emulator run without SDL or a display (batch boxes, ROM regression runs)
+#include <vector>
+#include "iobackend.h"
+#include "audio.h"
+#include "cpu.h"
+#include "rewind.h"
+
+// scripted input event
+struct input_event
+{
+    unsigned long cycle;
+    unsigned char key;
+    unsigned char state;
+};
+
+// loaded input script and the index of the next event to apply
+struct input_script
+{
+    std::vector<input_event> events;
+    unsigned int pos;
+};
+
+// null display backend - every call is a no-op
+extern const io_backend NULL_IO;
+
+// load an input script into memory
+// format: one event per line, "<cycle> <key> <state>"
+// cycle = instruction count the event applies at, key = 0-F (hex), state = 1 (down) or 0 (up)
+// blank lines and lines starting with '#' are ignored; events must be in cycle order
+int load_input_script(input_script &script, const char* filename);
+
+// apply every scripted event due at or before the given cycle to the machine's keypad
+void apply_input_script(input_script &script, unsigned long cycle, Chip8Machine &m);
+
+// checksum of a machine's display, RAM, V registers, PC and I, for comparing runs against each other
+unsigned long headless_checksum(const Chip8Machine &m);
+
+// run an initialised machine until it has executed max_cycles instructions in total
+// (0 = until the CPU stops), applying events as their cycles come up
+// the timers run on the virtual clock, one tick every tick_cycles instructions
+// rewind (NULL = none) records a history frame at every timer tick
+// wav (NULL = none) gets the sound timer's tones, in emulated time from the start of the run
+// returns non-zero if the CPU stopped itself
+int run_machine_headless(Chip8Machine &m, input_script &events, unsigned long max_cycles, unsigned long tick_cycles,
+    rewind_buffer *rewind, wav_writer *wav);
+
+// settings for a headless run (zero-initialise, then set what the run needs)
+struct headless_options
+{
+    // optional input script (NULL for no input)
+    const char* script;
+    // instructions to run (0 = until the CPU stops)
+    unsigned long max_cycles;
+    // instructions per 60Hz timer tick
+    unsigned long tick_cycles;
+    // run the machine on the recompiler when the host supports it
+    bool jit;
+    // restore a save state before the run, write one after it (NULL = none)
+    const char* load_state;
+    const char* save_state;
+    // > 0 records rewind history of up to this many bytes and reports its cost
+    unsigned long rewind_bytes;
+    // seed for the machine's random number generator
+    unsigned long seed;
+    // fast-forward through polling loops (see CPU_idle_check)
+    bool idle_skip;
+    // write the sound output to a WAV file (NULL = none)
+    const char* wav_file;
+};
+
+// library entry point: run the ROM fval headless as set out in opts
+int run_headless(char* fval, const headless_options &opts);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef IOBACKEND_H
+#define IOBACKEND_H
+
+// display backend interface used by the CPU
+// windowed runs use RENDER_IO (render.cpp), which hands frames to the render
+// thread that draws them with SDL (iohandle.cpp); the null (headless) backend
+// is in headless.cpp
+// this header does not pull in SDL so the CPU can be built and run without it
+#include <stdint.h>
+
+// display geometry (64 wide, 32 tall)
+#define DISPLAY_WIDTH 64
+#define DISPLAY_HEIGHT 32
+// SUPER-CHIP hi-res geometry (128 wide, 64 tall)
+#define DISPLAY_HIRES_WIDTH 128
+#define DISPLAY_HIRES_HEIGHT 64
+
+// the display is packed into 64-bit words, DISPLAY_WORDS per row (one 128-bit
+// hi-res row); the most significant bit of word 0 is the left-most pixel (x = 0)
+// a lo-res display only uses word 0 of rows 0-31, the rest stays zero
+#define DISPLAY_WORDS 2
+
+// pixel value (1 = on, 0 = off) of column x in one packed word
+#define DISPLAY_PIXEL(word, x) (((word) >> (63 - (x))) & 1)
+
+// pixel value of column x in a packed row (DISPLAY_WORDS words)
+#define DISPLAY_ROW_PIXEL(row, x) DISPLAY_PIXEL((row)[(x) >> 6], (x) & 63)
+
+// a packed display and the mode it is in
+// rows are 16 byte aligned so a row can be loaded as one SSE2 register
+struct display_buffer
+{
+    alignas(16) uint64_t rows[DISPLAY_HIRES_HEIGHT][DISPLAY_WORDS];
+    // 1 = hi-res (128x64), 0 = lo-res (64x32)
+    uint32_t hires;
+};
+
+// width and height of a display in its current mode
+inline int display_width(const display_buffer &d)
+{
+    return d.hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH;
+}
+
+inline int display_height(const display_buffer &d)
+{
+    return d.hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT;
+}
+
+// dirty row mask with every row of a display set
+#define DISPLAY_ALL_ROWS (~(uint64_t)0)
+
+struct io_backend
+{
+    // init the screen with the given pixel scale
+    bool (*screen_init)(int &xval);
+    // close/destroy the screen
+    void (*screen_close)();
+    // clear screen (in the mode of the last draw)
+    int (*clear_screen)();
+    // draws a packed display to the screen (see DISPLAY_ROW_PIXEL)
+    // dirty_rows has bit i set for each row i changed since the last draw
+    // (a mode change always comes with every row set)
+    int (*draw_screen)(const display_buffer &screen, uint64_t dirty_rows);
+};
+
+#endif
@@ -1,5 +1,7 @@
 //Using SDL, SDL_image, standard IO, math, and strings
 #include "iohandle.h"
+#include "profile.h"
+#include "scaler.h"
 
 //Screen dimension constants
 int S_SCALE = 10;
@@ -12,11 +14,39 @@ SDL_Window* gWindow = NULL;
 // The window renderer
 SDL_Renderer* gRenderer = NULL;
 
+// streaming texture holding the scaled display, copied to the window on present
+// (window sized, except for hi-res at an odd pixel size)
+SDL_Texture* gTexture = NULL;
+
+// CPU-side scaler that fills the texture (filter, scanlines and SIMD kernel)
+scaler gScaler;
+
+// filter settings from SDL_set_filter, and the display mode the texture is set up for
+int gFilter = FILTER_NONE;
+bool gScanlines = false;
+uint32_t gHires = 0;
+
 // SDL event variable
 SDL_Event evnt;
 
-// key state pointer
-const Uint8* cKeyStates;
+// audio device playing the sound timer (0 = none)
+SDL_AudioDeviceID gAudio = 0;
+
+// pick the upscaling filter and scanlines for pixel size xval (before SDL_screen_init)
+bool SDL_set_filter(int xval, int filter, bool scanlines)
+{
+	if (scaler_init(gScaler, xval, filter, scanlines) != 0)
+	{
+		return false;
+	}
+	gFilter = filter;
+	gScanlines = scanlines;
+	gHires = 0;
+	printf("Scaler: %dx, filter %s%s, %s kernel\n", xval,
+		filter == FILTER_SCALE3X ? "scale3x" : (filter == FILTER_SCALE2X ? "scale2x" : "none"),
+		scanlines ? " + scanlines" : "", gScaler.kernel_name);
+	return true;
+}
 
 // init the SDL screen and variables
 bool SDL_screen_init(int &xval)
@@ -24,7 +54,7 @@ bool SDL_screen_init(int &xval)
 	//Initialization flag
 	bool success = true;
 
-	// pixel size
+	// pixel size (the scaler was set up for it by SDL_set_filter)
 	S_SCALE = xval;
 	SCREEN_WIDTH = 64 * S_SCALE;
 	SCREEN_HEIGHT = 32 * S_SCALE;
@@ -37,10 +67,10 @@ bool SDL_screen_init(int &xval)
 	}
 	else
 	{
-		//Set texture filtering to linear
-		if( !SDL_SetHint( SDL_HINT_RENDER_SCALE_QUALITY, "1" ) )
+		//Set texture filtering to nearest so scaled pixels stay sharp
+		if( !SDL_SetHint( SDL_HINT_RENDER_SCALE_QUALITY, "0" ) )
 		{
-			printf( "Warning: Linear texture filtering not enabled!" );
+			printf( "Warning: Nearest texture filtering not enabled!" );
 		}
 
 		//Create window
@@ -53,7 +83,8 @@ bool SDL_screen_init(int &xval)
 		else
 		{
 			//Create renderer for window
-			gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED );
+			//Present is synced to the display refresh (the render thread paces itself on it)
+			gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
 			if( gRenderer == NULL )
 			{
 				printf( "Renderer could not be created! SDL Error: %s\n", SDL_GetError() );
@@ -64,6 +95,19 @@ bool SDL_screen_init(int &xval)
 				//Initialize renderer color
 				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
 
+				//Create the display texture (already scaled, one texel per window pixel)
+				gTexture = SDL_CreateTexture( gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT );
+				if( gTexture == NULL )
+				{
+					printf( "Texture could not be created! SDL Error: %s\n", SDL_GetError() );
+					success = false;
+				}
+				else
+				{
+					//Streaming textures start undefined - blank it
+					clear_screen();
+				}
+
 				//Initialize PNG loading
 				int imgFlags = IMG_INIT_PNG;
 				if( !( IMG_Init( imgFlags ) & imgFlags ) )
@@ -78,10 +122,58 @@ bool SDL_screen_init(int &xval)
 	return success;
 }
 
+// SDL audio callback: runs on SDL's audio thread and only renders from the player
+static void audio_callback(void *player, Uint8 *stream, int len)
+{
+	audio_fill(*(audio_player *)player, (int16_t *)stream, len / (int)sizeof(int16_t));
+}
+
+// open the default audio device and play p through it
+bool SDL_audio_init(audio_player &p, int buffer)
+{
+	if( SDL_InitSubSystem( SDL_INIT_AUDIO ) < 0 )
+	{
+		printf( "WARNING: no sound, SDL audio could not initialize! SDL Error: %s\n", SDL_GetError() );
+		return false;
+	}
+	SDL_AudioSpec want, have;
+	SDL_zero( want );
+	want.freq = AUDIO_RATE;
+	want.format = AUDIO_S16SYS;
+	want.channels = 1;
+	want.samples = buffer;
+	want.callback = audio_callback;
+	want.userdata = &p;
+	// take the device's rate and buffer size rather than have SDL resample
+	gAudio = SDL_OpenAudioDevice( NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE );
+	if( gAudio == 0 )
+	{
+		printf( "WARNING: no sound, audio device could not be opened! SDL Error: %s\n", SDL_GetError() );
+		return false;
+	}
+	// the device opens paused, so the player can be set up before the first callback
+	audio_init( p, have.freq, true, have.samples );
+	SDL_PauseAudioDevice( gAudio, 0 );
+	printf( "Audio: %d Hz, %d sample buffer\n", have.freq, have.samples );
+	return true;
+}
+
+// stop and close the audio device
+void SDL_audio_close()
+{
+	if( gAudio != 0 )
+	{
+		SDL_CloseAudioDevice( gAudio );
+		gAudio = 0;
+	}
+}
+
 // close/destroy the SDL program
 void SDL_screen_close()
 {
 	//Destroy window	
+	SDL_DestroyTexture( gTexture );
+	gTexture = NULL;
 	SDL_DestroyRenderer( gRenderer );
 	SDL_DestroyWindow( gWindow );
 	gWindow = NULL;
@@ -92,94 +184,198 @@ void SDL_screen_close()
 	SDL_Quit();
 }
 
-// clears the screen
-int clear_screen()
+// set the scaler and texture up for a display mode
+// hi-res pixels are half the size of lo-res ones, so the window keeps its size
+// (exactly when the pixel size is even)
+bool set_display_mode(uint32_t hires)
 {
-	// set render color
-	// r,g,b,a
-	SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xFF);
-	SDL_RenderClear(gRenderer);
+	int scale = S_SCALE;
+	int filter = gFilter;
+	if (hires)
+	{
+		scale = S_SCALE >= 2 ? S_SCALE / 2 : 1;
+		if (scale % scaler_factor(filter) != 0)
+		{
+			printf("WARNING: hi-res pixel size %d does not suit the filter, drawing hi-res unfiltered\n", scale);
+			filter = FILTER_NONE;
+		}
+	}
+	scaler_init(gScaler, scale, filter, gScanlines);
+	SDL_DestroyTexture( gTexture );
+	gTexture = SDL_CreateTexture( gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+		(hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH) * scale, (hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT) * scale );
+	if( gTexture == NULL )
+	{
+		printf( "Texture could not be created! SDL Error: %s\n", SDL_GetError() );
+		return false;
+	}
+	gHires = hires;
+	return true;
+}
+
+// scales the dirty rows into the texture and presents
+int draw_rows(const display_buffer &screen, uint64_t dirty_rows)
+{
+	if (screen.hires != gHires)
+	{
+		if (!set_display_mode(screen.hires))
+		{
+			return 1;
+		}
+		dirty_rows = DISPLAY_ALL_ROWS;
+	}
+	int width = display_width(screen);
+	int height = display_height(screen);
+	int scale = gScaler.scale;
+	// a filtered row also depends on the rows next to it
+	dirty_rows = scaler_dirty(gScaler, dirty_rows);
+	int i = 0;
+	while (i < height)
+	{
+		if (((dirty_rows >> i) & 1) == 0)
+		{
+			i++;
+			continue;
+		}
+		// scale a run of dirty rows straight into the locked texture
+		int first = i;
+		while (i < height && ((dirty_rows >> i) & 1))
+		{
+			i++;
+		}
+		SDL_Rect rows = {0, first * scale, width * scale, (i - first) * scale};
+		void *pixels;
+		int pitch;
+		if (SDL_LockTexture(gTexture, &rows, &pixels, &pitch) != 0)
+		{
+			continue;
+		}
+		scaler_draw(gScaler, screen.rows[0], DISPLAY_WORDS, width, height, first, i - first, (uint32_t *)pixels,
+			pitch / sizeof(Uint32));
+		SDL_UnlockTexture(gTexture);
+	}
+	// the texture is window sized (normally) - copy it 1:1
+	SDL_RenderCopy(gRenderer, gTexture, NULL, NULL);
 	// update the screen
 	SDL_RenderPresent(gRenderer);
 	return 0;
 }
 
-// draws a vector to the screen 
-int draw_screen_vector(std::vector<std::vector<unsigned char>> screen_vec)
+// clears the screen
+int clear_screen()
 {
-	// make a fill struct to hold pixel data
-	// {x, y, l, w}
-	SDL_Rect pixel;
-	// set render color
-	// r,g,b,a
-	SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
-    for(int i = 0; i < (int)screen_vec.size(); i++)
-    {
-        for(int j = 0; j < (int)screen_vec.at(i).size(); j++)
-        {
-            if (screen_vec.at(i).at(j) == 1)
-            {
-                // on pixel
-				// set render color
-				// r,g,b,a
-				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
-				pixel = {j*S_SCALE, i*S_SCALE, S_SCALE, S_SCALE};
-            }
-            else
-            {
-                // off pixel
-				// set render color
-				// r,g,b,a
-				SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xFF );
-				pixel = {j*S_SCALE, i*S_SCALE, S_SCALE, S_SCALE};
-            }
-			SDL_RenderFillRect(gRenderer, &pixel);
-        }
-    }
-	// update the screen
-	SDL_RenderPresent(gRenderer);
+	// blank the texture, in the current mode
+	static display_buffer blank;
+	blank.hires = gHires;
+	draw_rows(blank, DISPLAY_ALL_ROWS);
 	return 0;
 }
 
-// gets input from SDL events
-int SDL_input_event_handler(bool &exit_event, std::vector<unsigned char> &key_vector, int &kflag)
+// draws a packed display to the screen 
+int draw_screen_vector(const display_buffer &screen, uint64_t dirty_rows)
 {
-	// poll event
-	SDL_PollEvent(&evnt);
-	if (evnt.type == SDL_QUIT)
+	int status;
+	PROFILE_CALL(PROFILE_DRAW, status = draw_rows(screen, dirty_rows));
+	return status;
+}
+
+// refresh rate of the display the window is on, in Hz (60 if SDL can't tell)
+int SDL_refresh_rate()
+{
+	SDL_DisplayMode mode;
+	if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(gWindow), &mode) != 0 || mode.refresh_rate <= 0)
 	{
-		exit_event = true;
+		return 60;
 	}
-	// current key states are updated every event poll, grab current instance
-	cKeyStates = SDL_GetKeyboardState(NULL);
-	// set keys in key vector according to SDL scan code
-	// if kflag == 1, use special tetris keybindings
+	return mode.refresh_rate;
+}
+
+// map an SDL scancode to a chip8 key (-1 = not a chip8 key)
+// if kflag == 1, use special tetris keybindings
+int map_key(int scancode, int kflag)
+{
 	if (kflag == 1)
 	{
-		key_vector.at(4) = cKeyStates[SDL_SCANCODE_SPACE];
-		key_vector.at(5) = cKeyStates[SDL_SCANCODE_LEFT];
-		key_vector.at(6) = cKeyStates[SDL_SCANCODE_RIGHT];
-		key_vector.at(7) = cKeyStates[SDL_SCANCODE_DOWN];
+		switch (scancode)
+		{
+		case SDL_SCANCODE_SPACE:
+			return 4;
+		case SDL_SCANCODE_LEFT:
+			return 5;
+		case SDL_SCANCODE_RIGHT:
+			return 6;
+		case SDL_SCANCODE_DOWN:
+			return 7;
+		default:
+			return -1;
+		}
 	}
-	else
+	// 0-9 then A-F
+	if (scancode == SDL_SCANCODE_0)
+	{
+		return 0;
+	}
+	if (scancode >= SDL_SCANCODE_1 && scancode <= SDL_SCANCODE_9)
+	{
+		return 1 + (scancode - SDL_SCANCODE_1);
+	}
+	if (scancode >= SDL_SCANCODE_A && scancode <= SDL_SCANCODE_F)
 	{
-		key_vector.at(0) = cKeyStates[SDL_SCANCODE_0];
-		key_vector.at(1) = cKeyStates[SDL_SCANCODE_1];
-		key_vector.at(2) = cKeyStates[SDL_SCANCODE_2];
-		key_vector.at(3) = cKeyStates[SDL_SCANCODE_3];
-		key_vector.at(4) = cKeyStates[SDL_SCANCODE_4];
-		key_vector.at(5) = cKeyStates[SDL_SCANCODE_5];
-		key_vector.at(6) = cKeyStates[SDL_SCANCODE_6];
-		key_vector.at(7) = cKeyStates[SDL_SCANCODE_7];
-		key_vector.at(8) = cKeyStates[SDL_SCANCODE_8];
-		key_vector.at(9) = cKeyStates[SDL_SCANCODE_9];
-		key_vector.at(10) = cKeyStates[SDL_SCANCODE_A];
-		key_vector.at(11) = cKeyStates[SDL_SCANCODE_B];
-		key_vector.at(12) = cKeyStates[SDL_SCANCODE_C];
-		key_vector.at(13) = cKeyStates[SDL_SCANCODE_D];
-		key_vector.at(14) = cKeyStates[SDL_SCANCODE_E];
-		key_vector.at(15) = cKeyStates[SDL_SCANCODE_F];
+		return 10 + (scancode - SDL_SCANCODE_A);
 	}
+	return -1;
+}
+
+// map an SDL scancode to a host command hotkey (-1 = not a hotkey)
+int map_command(int scancode)
+{
+	switch (scancode)
+	{
+	case SDL_SCANCODE_F5:
+		return KEY_CMD_SAVE;
+	case SDL_SCANCODE_F9:
+		return KEY_CMD_LOAD;
+	case SDL_SCANCODE_BACKSPACE:
+		return KEY_CMD_REWIND;
+	case SDL_SCANCODE_TAB:
+		return KEY_CMD_FASTFWD;
+	default:
+		return -1;
+	}
+}
+
+// gets input from SDL events
+int SDL_input_event_handler(std::atomic<bool> &exit_event, key_ring &ring, int &kflag)
+{
+	// block until an event arrives (or the timeout, so shutdown is noticed)
+	if (!SDL_WaitEventTimeout(&evnt, 100))
+	{
+		return 0;
+	}
+	// handle that event and everything else already queued
+	do
+	{
+		if (evnt.type == SDL_QUIT)
+		{
+			exit_event = true;
+		}
+		else if ((evnt.type == SDL_KEYDOWN || evnt.type == SDL_KEYUP) && evnt.key.repeat == 0)
+		{
+			int key = map_key(evnt.key.keysym.scancode, kflag);
+			if (key < 0)
+			{
+				key = map_command(evnt.key.keysym.scancode);
+			}
+			if (key >= 0)
+			{
+				key_event ev = {key_stamp(), (unsigned char)key, (unsigned char)(evnt.type == SDL_KEYDOWN ? 1 : 0)};
+				if (!key_ring_push(ring, ev))
+				{
+					printf("%s","WARNING: key event queue full, dropping event\n");
+				}
+			}
+		}
+	} while (SDL_PollEvent(&evnt));
 	// return
 	return 0;
-}
\ No newline at end of file
+}
@@ -5,8 +5,16 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <stdio.h>
+#include <atomic>
 #include <string>
 #include <vector>
+#include "audio.h"
+#include "iobackend.h"
+#include "keyring.h"
+
+// pick the upscaling filter (FILTER_*) and scanlines for pixel size xval
+// call before SDL_screen_init; returns false (after printing why) if they don't fit together
+bool SDL_set_filter(int xval, int filter, bool scanlines);
 
 // init the SDL screen and variables
 bool SDL_screen_init(int &xval);
@@ -17,10 +25,33 @@ void SDL_screen_close();
 // clear screen
 int clear_screen();
 
-// draws a vector to the screen
-int draw_screen_vector(std::vector<std::vector<unsigned char>> screen_vec);
+// draws a packed display to the screen
+// only the rows set in dirty_rows (and, with a filter, their neighbours) are
+// rescaled into the screen texture
+// a mode change (see display_buffer.hires) rebuilds the texture at the new size
+int draw_screen_vector(const display_buffer &screen, uint64_t dirty_rows);
+
+// open the default audio device and play p through it, rendering from SDL's
+// audio callback (set up with audio_init for the rate and buffer the device gives)
+// buffer is the device buffer size in samples
+// returns false (after printing why) if there is no audio device
+bool SDL_audio_init(audio_player &p, int buffer);
+
+// stop and close the audio device (before SDL_screen_close)
+void SDL_audio_close();
+
+// refresh rate of the display the window is on, in Hz (60 if unknown)
+int SDL_refresh_rate();
+
+// map an SDL scancode to a chip8 key (-1 = not a chip8 key)
+int map_key(int scancode, int kflag);
+
+// map an SDL scancode to a host command hotkey (KEY_CMD_*, -1 = not a hotkey)
+int map_command(int scancode);
 
 // input handler for SDL-based events
-int SDL_input_event_handler(bool &exit_event, std::vector<unsigned char> &key_vector, int &kflag);
+// blocks for up to 100ms waiting for events, then pushes every chip8 key change
+// into ring for the CPU thread to apply
+int SDL_input_event_handler(std::atomic<bool> &exit_event, key_ring &ring, int &kflag);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1027 @@
+// x86-64 basic-block recompiler for the chip8 CPU
+//
+// a block is a straight run of instructions starting at some PC. it ends at the
+// first jump, call, return or skip (1NNN, 2NNN, 00EE, BNNN, 3XNN, 4XNN, 5XY0,
+// 9XY0, EX9E, EXA1), at FX0A, or after JIT_MAX_BLOCK instructions. a store
+// (FX33/FX55) only ends it early if it wrote over compiled code.
+// register and arithmetic instructions are translated to native code; the rest
+// (00E0, CXNN, DXYN, EX, FX07/15/18 timers, FX0A, FX33, FX55, FX65...) call the normal op handlers,
+// which stay the slow path. inside a block the guest registers V0-VF and I live
+// in host registers and are only written back to the machine at block exits and
+// before a handler call.
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <vector>
+
+// code buffer size per machine
+#define JIT_CODE_SIZE (1 << 20)
+
+// maximum instructions per block
+#define JIT_MAX_BLOCK 64
+
+// guest register index used for I (V0-VF are 0-15)
+#define GUEST_IND 16
+
+// compiled block: runs on the machine, returns a non-zero handler status or 0
+typedef int (*jit_block_fn)(Chip8Machine *m);
+
+// per machine recompiler state
+struct jit_state
+{
+    // code buffer and how much of it is used (never writable and executable at
+    // once: pages are made writable while a block is copied in, then executable)
+    unsigned char *code;
+    size_t used;
+    // compiled block for each start address (NULL = not compiled)
+    jit_block_fn entry[RAM_SIZE];
+    // first address past the block and its instruction count
+    unsigned short block_end[RAM_SIZE];
+    unsigned char block_len[RAM_SIZE];
+    // one bit per RAM address, set while a compiled block covers it, so stores
+    // to data are let through without looking for blocks to drop
+    uint64_t covered[RAM_SIZE / 64];
+    // set when a store dropped compiled blocks - the block that made it
+    // (possibly one of them) exits instead of running on
+    unsigned char stale;
+};
+
+// set or clear the coverage bits for addresses from up to (not including) to
+static void cover(jit_state &j, int from, int to, bool on)
+{
+    for (int a = from; a < to; a++)
+    {
+        if (on)
+        {
+            j.covered[a >> 6] = j.covered[a >> 6] | (1UL << (a & 63));
+        }
+        else
+        {
+            j.covered[a >> 6] = j.covered[a >> 6] & ~(1UL << (a & 63));
+        }
+    }
+}
+
+// true if any address from up to (not including) to is covered by a block
+static bool covers(const jit_state &j, int from, int to)
+{
+    for (int a = from; a < to; a++)
+    {
+        if (j.covered[a >> 6] & (1UL << (a & 63)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// host registers
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// host registers that hold guest registers (rbx holds the machine pointer,
+// rax/rcx/rdx are scratch)
+// caller-saved registers come first so short blocks don't need to save anything
+static const int POOL[] = {RSI, RDI, R8, R9, R10, R11, RBP, R12, R13, R14, R15};
+#define POOL_SIZE 11
+
+// condition codes (low nibble of setcc/cmovcc)
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+
+// ALU opcodes (op r/m32, r32 form) and their /digit for the immediate form
+#define OP_ADD 0x01
+#define OP_OR 0x09
+#define OP_AND 0x21
+#define OP_SUB 0x29
+#define OP_XOR 0x31
+#define OP_CMP 0x39
+#define OP_MOV 0x89
+#define EXT_ADD 0
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+// machine field offsets used by the generated code
+#define OFF_PC ((int)offsetof(Chip8Machine, PC))
+#define OFF_IND ((int)offsetof(Chip8Machine, IND))
+#define OFF_SP ((int)offsetof(Chip8Machine, SP))
+#define OFF_OPCODE ((int)offsetof(Chip8Machine, OPCODE))
+#define OFF_CYCLES ((int)offsetof(Chip8Machine, cycles))
+#define OFF_VAR ((int)offsetof(Chip8Machine, VAR))
+#define OFF_STACK ((int)offsetof(Chip8Machine, STACK))
+#define OFF_DCACHE ((int)offsetof(Chip8Machine, DCACHE))
+
+// block being compiled
+struct jit_compiler
+{
+    // generated code
+    std::vector<unsigned char> c;
+    // guest register -> host register (-1 = only in the machine)
+    int host[17];
+    // guest register was changed since it was loaded
+    bool dirty[17];
+    // host register -> guest register (-1 = free)
+    int owner[16];
+    // host register is used by the instruction being compiled
+    bool locked[16];
+    // host register was used anywhere in the block (callee-saved ones need saving)
+    bool used[16];
+    // next pool slot to evict
+    int victim;
+    // rel32 fields of jumps to the block epilogue
+    std::vector<size_t> exits;
+};
+
+// ---- instruction encoding ----
+
+static void emit8(jit_compiler &jc, unsigned int b)
+{
+    jc.c.push_back((unsigned char)b);
+}
+
+static void emit16(jit_compiler &jc, unsigned int v)
+{
+    emit8(jc, v & 0xFF);
+    emit8(jc, (v >> 8) & 0xFF);
+}
+
+static void emit32(jit_compiler &jc, unsigned int v)
+{
+    emit16(jc, v & 0xFFFF);
+    emit16(jc, (v >> 16) & 0xFFFF);
+}
+
+static void emit64(jit_compiler &jc, unsigned long v)
+{
+    emit32(jc, (unsigned int)v);
+    emit32(jc, (unsigned int)(v >> 32));
+}
+
+// REX prefix for a reg/rm pair; force emits it even when empty (byte access to sil/dil/bpl)
+static void rex(jit_compiler &jc, bool w, int reg, int rm, bool force)
+{
+    unsigned int r = 0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+    if (r != 0x40 || force)
+    {
+        emit8(jc, r);
+    }
+}
+
+// ModRM for [rbx + disp32]
+static void mem_rbx(jit_compiler &jc, int reg, int disp)
+{
+    emit8(jc, 0x80 | ((reg & 7) << 3) | RBX);
+    emit32(jc, (unsigned int)disp);
+}
+
+// op dst, src (32 bit)
+static void alu_rr(jit_compiler &jc, unsigned int op, int dst, int src)
+{
+    rex(jc, false, src, dst, false);
+    emit8(jc, op);
+    emit8(jc, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// op dst, imm32 (32 bit)
+static void alu_ri(jit_compiler &jc, int ext, int dst, unsigned int imm)
+{
+    rex(jc, false, 0, dst, false);
+    emit8(jc, 0x81);
+    emit8(jc, 0xC0 | (ext << 3) | (dst & 7));
+    emit32(jc, imm);
+}
+
+// mov dst, imm32
+static void mov_ri(jit_compiler &jc, int dst, unsigned int imm)
+{
+    rex(jc, false, 0, dst, false);
+    emit8(jc, 0xB8 + (dst & 7));
+    emit32(jc, imm);
+}
+
+// shl/shr dst, 1
+static void shift1(jit_compiler &jc, int ext, int dst)
+{
+    rex(jc, false, 0, dst, false);
+    emit8(jc, 0xD1);
+    emit8(jc, 0xC0 | (ext << 3) | (dst & 7));
+}
+
+// shl/shr dst, imm8
+static void shift_ri(jit_compiler &jc, int ext, int dst, unsigned int imm)
+{
+    rex(jc, false, 0, dst, false);
+    emit8(jc, 0xC1);
+    emit8(jc, 0xC0 | (ext << 3) | (dst & 7));
+    emit8(jc, imm);
+}
+
+// setcc dst8
+static void setcc(jit_compiler &jc, int cc, int dst)
+{
+    rex(jc, false, 0, dst, true);
+    emit8(jc, 0x0F);
+    emit8(jc, 0x90 | cc);
+    emit8(jc, 0xC0 | (dst & 7));
+}
+
+// cmovcc dst, src (32 bit)
+static void cmov(jit_compiler &jc, int cc, int dst, int src)
+{
+    rex(jc, false, dst, src, false);
+    emit8(jc, 0x0F);
+    emit8(jc, 0x40 | cc);
+    emit8(jc, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// movzx dst, byte [rbx + disp]
+static void load8(jit_compiler &jc, int dst, int disp)
+{
+    rex(jc, false, dst, 0, false);
+    emit8(jc, 0x0F);
+    emit8(jc, 0xB6);
+    mem_rbx(jc, dst, disp);
+}
+
+// movzx dst, word [rbx + disp]
+static void load16(jit_compiler &jc, int dst, int disp)
+{
+    rex(jc, false, dst, 0, false);
+    emit8(jc, 0x0F);
+    emit8(jc, 0xB7);
+    mem_rbx(jc, dst, disp);
+}
+
+// mov byte [rbx + disp], src8
+static void store8(jit_compiler &jc, int disp, int src)
+{
+    rex(jc, false, src, 0, true);
+    emit8(jc, 0x88);
+    mem_rbx(jc, src, disp);
+}
+
+// mov word [rbx + disp], src16
+static void store16(jit_compiler &jc, int disp, int src)
+{
+    emit8(jc, 0x66);
+    rex(jc, false, src, 0, false);
+    emit8(jc, 0x89);
+    mem_rbx(jc, src, disp);
+}
+
+// mov word [rbx + disp], imm16
+static void store16_imm(jit_compiler &jc, int disp, unsigned int imm)
+{
+    emit8(jc, 0x66);
+    emit8(jc, 0xC7);
+    mem_rbx(jc, 0, disp);
+    emit16(jc, imm);
+}
+
+// add qword [rbx + OFF_CYCLES], n
+static void add_cycles(jit_compiler &jc, unsigned int n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    rex(jc, true, 0, 0, false);
+    emit8(jc, 0x81);
+    mem_rbx(jc, EXT_ADD, OFF_CYCLES);
+    emit32(jc, n);
+}
+
+// jnz to the block epilogue (patched once the epilogue is placed)
+static void jnz_exit(jit_compiler &jc)
+{
+    emit8(jc, 0x0F);
+    emit8(jc, 0x85);
+    jc.exits.push_back(jc.c.size());
+    emit32(jc, 0);
+}
+
+// ---- guest register cache ----
+
+static void load_guest(jit_compiler &jc, int g, int h)
+{
+    if (g == GUEST_IND)
+    {
+        load16(jc, h, OFF_IND);
+    }
+    else
+    {
+        load8(jc, h, OFF_VAR + g);
+    }
+}
+
+static void store_guest(jit_compiler &jc, int g, int h)
+{
+    if (g == GUEST_IND)
+    {
+        store16(jc, OFF_IND, h);
+    }
+    else
+    {
+        store8(jc, OFF_VAR + g, h);
+    }
+}
+
+// write a host register back to its guest register and free it
+static void spill(jit_compiler &jc, int h)
+{
+    int g = jc.owner[h];
+    if (jc.dirty[g])
+    {
+        store_guest(jc, g, h);
+    }
+    jc.dirty[g] = false;
+    jc.host[g] = -1;
+    jc.owner[h] = -1;
+}
+
+// host register holding guest register g, loading it from the machine when load is set
+static int guest_reg(jit_compiler &jc, int g, bool load)
+{
+    int h = jc.host[g];
+    if (h < 0)
+    {
+        for (int i = 0; i < POOL_SIZE; i++)
+        {
+            if (jc.owner[POOL[i]] < 0)
+            {
+                h = POOL[i];
+                break;
+            }
+        }
+        if (h < 0)
+        {
+            // evict round robin, skipping registers this instruction already uses
+            while (jc.locked[POOL[jc.victim]])
+            {
+                jc.victim = (jc.victim + 1) % POOL_SIZE;
+            }
+            h = POOL[jc.victim];
+            jc.victim = (jc.victim + 1) % POOL_SIZE;
+            spill(jc, h);
+        }
+        jc.owner[h] = g;
+        jc.host[g] = h;
+        jc.used[h] = true;
+        if (load)
+        {
+            load_guest(jc, g, h);
+        }
+    }
+    jc.locked[h] = true;
+    return h;
+}
+
+// guest register g is about to be written with a new value
+static int guest_def(jit_compiler &jc, int g)
+{
+    int h = guest_reg(jc, g, false);
+    jc.dirty[g] = true;
+    return h;
+}
+
+// write back every changed guest register; forget drops the mappings too
+// (needed before a handler call, which may read or change any register)
+static void flush_guests(jit_compiler &jc, bool forget)
+{
+    for (int i = 0; i < POOL_SIZE; i++)
+    {
+        int h = POOL[i];
+        if (jc.owner[h] < 0)
+        {
+            continue;
+        }
+        if (forget)
+        {
+            spill(jc, h);
+        }
+        else if (jc.dirty[jc.owner[h]])
+        {
+            store_guest(jc, jc.owner[h], h);
+            jc.dirty[jc.owner[h]] = false;
+        }
+    }
+}
+
+// ---- block compiler ----
+
+// call the normal handler for the instruction at addr
+// pending = instructions run since the last cycle count update (including this one)
+static void emit_slow(jit_compiler &jc, const Chip8Inst &in, unsigned short addr, unsigned int pending)
+{
+    flush_guests(jc, true);
+    store16_imm(jc, OFF_PC, addr + 2);
+    store16_imm(jc, OFF_OPCODE, in.opcode);
+    add_cycles(jc, pending);
+    // handler(*m, DCACHE[addr])
+    emit8(jc, 0x48); emit8(jc, 0x89); emit8(jc, 0xDF);            // mov rdi, rbx
+    emit8(jc, 0x48); emit8(jc, 0x8D);                              // lea rsi, [rbx + disp32]
+    mem_rbx(jc, RSI, OFF_DCACHE + addr * (int)sizeof(Chip8Inst));
+    emit8(jc, 0x48); emit8(jc, 0xB8);                              // mov rax, imm64
+    emit64(jc, (unsigned long)in.handler);
+    emit8(jc, 0xFF); emit8(jc, 0xD0);                              // call rax
+}
+
+// end the block at a conditional skip: PC = next (+2 if the flags say cc)
+static void emit_skip_exit(jit_compiler &jc, int cc, unsigned short next)
+{
+    mov_ri(jc, RCX, next);
+    mov_ri(jc, RDX, next + 2);
+    cmov(jc, cc, RCX, RDX);
+    store16(jc, OFF_PC, RCX);
+}
+
+// compile the block starting at start into jc; returns its instruction count (0 = nothing to compile)
+static int compile_block(Chip8Machine &m, jit_compiler &jc, unsigned short start, unsigned short &end)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        jc.owner[i] = -1;
+        jc.locked[i] = false;
+        jc.used[i] = false;
+    }
+    for (int i = 0; i < 17; i++)
+    {
+        jc.host[i] = -1;
+        jc.dirty[i] = false;
+    }
+    jc.victim = 0;
+
+    unsigned short addr = start;
+    int count = 0;
+    unsigned int pending = 0;
+    // the last instruction handed control to a handler that set PC and the status
+    bool handler_exit = false;
+    bool done = false;
+    unsigned short last_opcode = 0;
+
+    while (!done && count < JIT_MAX_BLOCK && addr + 1 < RAM_SIZE)
+    {
+        Chip8Inst &in = m.DCACHE[addr];
+        if (in.handler == NULL)
+        {
+            decode_inst(m, addr);
+        }
+        // leave the NULL opcode to the interpreter, which stops the CPU
+        if (in.opcode == 0)
+        {
+            break;
+        }
+        for (int i = 0; i < 16; i++)
+        {
+            jc.locked[i] = false;
+        }
+        count = count + 1;
+        pending = pending + 1;
+        last_opcode = in.opcode;
+        unsigned short next = addr + 2;
+        int x = in.x;
+        int y = in.y;
+        int rx, ry, rf, ri;
+
+        switch (in.opcode >> 12)
+        {
+        case 0x0:
+            if (in.opcode == 0x00EE)
+            {
+                // PC = STACK[SP], SP = SP - 1
+                flush_guests(jc, false);
+                load16(jc, RAX, OFF_SP);
+                alu_rr(jc, OP_MOV, RCX, RAX);
+                alu_ri(jc, EXT_AND, RCX, STACK_MASK);
+                // movzx edx, word [rbx + rcx*2 + STACK]
+                emit8(jc, 0x0F); emit8(jc, 0xB7); emit8(jc, 0x94); emit8(jc, 0x4B);
+                emit32(jc, OFF_STACK);
+                store16(jc, OFF_PC, RDX);
+                alu_ri(jc, EXT_SUB, RAX, 1);
+                store16(jc, OFF_SP, RAX);
+                done = true;
+            }
+            else
+            {
+                emit_slow(jc, in, addr, pending);
+                pending = 0;
+                emit8(jc, 0x85); emit8(jc, 0xC0);        // test eax, eax
+                jnz_exit(jc);
+            }
+            break;
+        case 0x1:
+            // jump
+            flush_guests(jc, false);
+            store16_imm(jc, OFF_PC, in.nnn);
+            done = true;
+            break;
+        case 0x2:
+            // SP = SP + 1, STACK[SP] = PC, PC = NNN
+            flush_guests(jc, false);
+            load16(jc, RAX, OFF_SP);
+            alu_ri(jc, EXT_ADD, RAX, 1);
+            store16(jc, OFF_SP, RAX);
+            alu_ri(jc, EXT_AND, RAX, STACK_MASK);
+            // mov word [rbx + rax*2 + STACK], next
+            emit8(jc, 0x66); emit8(jc, 0xC7); emit8(jc, 0x84); emit8(jc, 0x43);
+            emit32(jc, OFF_STACK);
+            emit16(jc, next);
+            store16_imm(jc, OFF_PC, in.nnn);
+            done = true;
+            break;
+        case 0x3:
+        case 0x4:
+            rx = guest_reg(jc, x, true);
+            flush_guests(jc, false);
+            alu_ri(jc, EXT_CMP, rx, in.nn);
+            emit_skip_exit(jc, (in.opcode >> 12) == 0x3 ? CC_E : CC_NE, next);
+            done = true;
+            break;
+        case 0x5:
+        case 0x9:
+            rx = guest_reg(jc, x, true);
+            ry = guest_reg(jc, y, true);
+            flush_guests(jc, false);
+            alu_rr(jc, OP_CMP, rx, ry);
+            emit_skip_exit(jc, (in.opcode >> 12) == 0x5 ? CC_E : CC_NE, next);
+            done = true;
+            break;
+        case 0x6:
+            rx = guest_def(jc, x);
+            mov_ri(jc, rx, in.nn);
+            break;
+        case 0x7:
+            rx = guest_reg(jc, x, true);
+            jc.dirty[x] = true;
+            alu_ri(jc, EXT_ADD, rx, in.nn);
+            alu_ri(jc, EXT_AND, rx, 0xFF);
+            break;
+        case 0x8:
+            // same order of reads and writes as op8, so X or Y = F behaves the same
+            rx = guest_reg(jc, x, true);
+            ry = guest_reg(jc, y, true);
+            switch (in.n)
+            {
+            case 0x0:
+                jc.dirty[x] = true;
+                alu_rr(jc, OP_MOV, rx, ry);
+                break;
+            case 0x1:
+                jc.dirty[x] = true;
+                alu_rr(jc, OP_OR, rx, ry);
+                break;
+            case 0x2:
+                jc.dirty[x] = true;
+                alu_rr(jc, OP_AND, rx, ry);
+                break;
+            case 0x3:
+                jc.dirty[x] = true;
+                alu_rr(jc, OP_XOR, rx, ry);
+                break;
+            case 0x4:
+                // VX = VX + VY, VF = (VX + VY >= 255)
+                alu_rr(jc, OP_MOV, RAX, rx);
+                alu_rr(jc, OP_ADD, RAX, ry);
+                alu_rr(jc, OP_XOR, RCX, RCX);
+                alu_ri(jc, EXT_CMP, RAX, 255);
+                setcc(jc, CC_AE, RCX);
+                alu_ri(jc, EXT_AND, RAX, 0xFF);
+                jc.dirty[x] = true;
+                alu_rr(jc, OP_MOV, rx, RAX);
+                rf = guest_def(jc, 15);
+                alu_rr(jc, OP_MOV, rf, RCX);
+                break;
+            case 0x5:
+            case 0x7:
+                // VF = (VX > VY), then VX = VX - VY (or VY > VX, VX = VY - VX for 7)
+                alu_rr(jc, OP_XOR, RCX, RCX);
+                if (in.n == 0x5)
+                {
+                    alu_rr(jc, OP_CMP, rx, ry);
+                }
+                else
+                {
+                    alu_rr(jc, OP_CMP, ry, rx);
+                }
+                setcc(jc, CC_A, RCX);
+                rf = guest_def(jc, 15);
+                alu_rr(jc, OP_MOV, rf, RCX);
+                if (in.n == 0x5)
+                {
+                    alu_rr(jc, OP_MOV, RAX, rx);
+                    alu_rr(jc, OP_SUB, RAX, ry);
+                }
+                else
+                {
+                    alu_rr(jc, OP_MOV, RAX, ry);
+                    alu_rr(jc, OP_SUB, RAX, rx);
+                }
+                alu_ri(jc, EXT_AND, RAX, 0xFF);
+                jc.dirty[x] = true;
+                alu_rr(jc, OP_MOV, rx, RAX);
+                break;
+            case 0x6:
+                // VF = VX & 1, VX = VX >> 1
+                alu_rr(jc, OP_MOV, RCX, rx);
+                alu_ri(jc, EXT_AND, RCX, 0x01);
+                rf = guest_def(jc, 15);
+                alu_rr(jc, OP_MOV, rf, RCX);
+                jc.dirty[x] = true;
+                shift1(jc, EXT_SHR, rx);
+                break;
+            case 0xE:
+                // VF = VX >> 7, VX = VX << 1
+                alu_rr(jc, OP_MOV, RCX, rx);
+                shift_ri(jc, EXT_SHR, RCX, 7);
+                rf = guest_def(jc, 15);
+                alu_rr(jc, OP_MOV, rf, RCX);
+                jc.dirty[x] = true;
+                shift1(jc, EXT_SHL, rx);
+                alu_ri(jc, EXT_AND, rx, 0xFF);
+                break;
+            default:
+                // undefined 8XY? variants do nothing
+                break;
+            }
+            break;
+        case 0xA:
+            ri = guest_def(jc, GUEST_IND);
+            mov_ri(jc, ri, in.nnn);
+            break;
+        case 0xB:
+            // PC = NNN + V0
+            rx = guest_reg(jc, 0, true);
+            flush_guests(jc, false);
+            alu_rr(jc, OP_MOV, RAX, rx);
+            alu_ri(jc, EXT_ADD, RAX, in.nnn);
+            store16(jc, OFF_PC, RAX);
+            done = true;
+            break;
+        case 0xE:
+            // key skips end the block inside the handler
+            emit_slow(jc, in, addr, pending);
+            pending = 0;
+            handler_exit = true;
+            done = true;
+            break;
+        case 0xF:
+            if (in.nn == 0x1E)
+            {
+                // I = I + VX, VF = 1 if I leaves 0x000-0xFFF
+                rx = guest_reg(jc, x, true);
+                ri = guest_reg(jc, GUEST_IND, true);
+                jc.dirty[GUEST_IND] = true;
+                alu_rr(jc, OP_ADD, ri, rx);
+                alu_ri(jc, EXT_AND, ri, 0xFFFF);
+                rf = guest_reg(jc, 15, true);
+                jc.dirty[15] = true;
+                mov_ri(jc, RCX, 1);
+                alu_ri(jc, EXT_CMP, ri, 0x0FFF);
+                cmov(jc, CC_A, rf, RCX);
+            }
+            else if (in.nn == 0x29)
+            {
+                // I = 0x50 + 5 * (VX & 0xF)
+                rx = guest_reg(jc, x, true);
+                alu_rr(jc, OP_MOV, RAX, rx);
+                alu_ri(jc, EXT_AND, RAX, 0x0F);
+                emit8(jc, 0x8D); emit8(jc, 0x04); emit8(jc, 0x80);  // lea eax, [rax + rax*4]
+                alu_ri(jc, EXT_ADD, RAX, 0x50);
+                ri = guest_def(jc, GUEST_IND);
+                alu_rr(jc, OP_MOV, ri, RAX);
+            }
+            else if (in.nn == 0x0A)
+            {
+                // FX0A moves PC
+                emit_slow(jc, in, addr, pending);
+                pending = 0;
+                handler_exit = true;
+                done = true;
+            }
+            else if (in.nn == 0x33 || in.nn == 0x55)
+            {
+                // a store exits if it dropped compiled code, which may be the rest of this block
+                emit_slow(jc, in, addr, pending);
+                pending = 0;
+                emit8(jc, 0x85); emit8(jc, 0xC0);        // test eax, eax
+                jnz_exit(jc);
+                emit8(jc, 0x48); emit8(jc, 0xB9);        // mov rcx, imm64
+                emit64(jc, (unsigned long)&m.jit->stale);
+                emit8(jc, 0x80); emit8(jc, 0x39); emit8(jc, 0x00);  // cmp byte [rcx], 0
+                jnz_exit(jc);
+            }
+            else
+            {
+                emit_slow(jc, in, addr, pending);
+                pending = 0;
+                emit8(jc, 0x85); emit8(jc, 0xC0);        // test eax, eax
+                jnz_exit(jc);
+            }
+            break;
+        default:
+            // 00E0, CXNN, DXYN - handler call, then keep going
+            emit_slow(jc, in, addr, pending);
+            pending = 0;
+            emit8(jc, 0x85); emit8(jc, 0xC0);            // test eax, eax
+            jnz_exit(jc);
+            break;
+        }
+        addr = next;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (!handler_exit)
+    {
+        // normal exit: write back registers, fall through PC if nothing set it
+        flush_guests(jc, false);
+        if (!done)
+        {
+            store16_imm(jc, OFF_PC, addr);
+        }
+        store16_imm(jc, OFF_OPCODE, last_opcode);
+        add_cycles(jc, pending);
+        alu_rr(jc, OP_XOR, RAX, RAX);
+    }
+
+    // the body is done, so we know which callee-saved registers it used
+    // wrap it in a prologue that saves them (rbx = machine, stack kept 16 byte
+    // aligned for handler calls) and an epilogue every exit lands on with the
+    // status in eax
+    std::vector<unsigned char> body;
+    body.swap(jc.c);
+    int saved[6];
+    int nsaved = 0;
+    saved[nsaved++] = RBX;
+    const int callee[] = {RBP, R12, R13, R14, R15};
+    for (int i = 0; i < 5; i++)
+    {
+        if (jc.used[callee[i]])
+        {
+            saved[nsaved++] = callee[i];
+        }
+    }
+    for (int i = 0; i < nsaved; i++)
+    {
+        rex(jc, false, 0, saved[i], false);
+        emit8(jc, 0x50 + (saved[i] & 7));            // push reg
+    }
+    bool pad = (nsaved % 2) == 0;
+    if (pad)
+    {
+        emit8(jc, 0x48); emit8(jc, 0x83); emit8(jc, 0xEC); emit8(jc, 0x08);  // sub rsp, 8
+    }
+    emit8(jc, 0x48); emit8(jc, 0x89); emit8(jc, 0xFB);                       // mov rbx, rdi
+    size_t body_start = jc.c.size();
+    jc.c.insert(jc.c.end(), body.begin(), body.end());
+    for (unsigned int i = 0; i < jc.exits.size(); i++)
+    {
+        size_t at = body_start + jc.exits[i];
+        unsigned int rel = (unsigned int)(jc.c.size() - (at + 4));
+        for (int b = 0; b < 4; b++)
+        {
+            jc.c[at + b] = (rel >> (8 * b)) & 0xFF;
+        }
+    }
+    if (pad)
+    {
+        emit8(jc, 0x48); emit8(jc, 0x83); emit8(jc, 0xC4); emit8(jc, 0x08);  // add rsp, 8
+    }
+    for (int i = nsaved - 1; i >= 0; i--)
+    {
+        rex(jc, false, 0, saved[i], false);
+        emit8(jc, 0x58 + (saved[i] & 7));            // pop reg
+    }
+    emit8(jc, 0xC3);                                 // ret
+    end = addr;
+    return count;
+}
+
+// change the protection of the code buffer pages holding len bytes at offset from
+static int code_protect(jit_state &j, size_t from, size_t len, int prot)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = from / page * page;
+    size_t end = (from + len + page - 1) / page * page;
+    return mprotect(j.code + start, end - start, prot);
+}
+
+// compile the block at start and install it; returns NULL if there is nothing to compile
+static jit_block_fn build_block(Chip8Machine &m, unsigned short start)
+{
+    jit_state &j = *m.jit;
+    jit_compiler jc;
+    unsigned short end = start;
+    int count = compile_block(m, jc, start, end);
+    if (count == 0)
+    {
+        return NULL;
+    }
+    if (j.used + jc.c.size() > JIT_CODE_SIZE)
+    {
+        // out of code space - start over (only happens between blocks)
+        jit_invalidate_all(m);
+        j.used = 0;
+    }
+    // no block is running while one is built, so the pages can be writable for a moment
+    if (code_protect(j, j.used, jc.c.size(), PROT_READ | PROT_WRITE) != 0)
+    {
+        // leave this block to the interpreter
+        return NULL;
+    }
+    unsigned char *code = j.code + j.used;
+    memcpy(code, jc.c.data(), jc.c.size());
+    if (code_protect(j, j.used, jc.c.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        return NULL;
+    }
+    j.used = j.used + jc.c.size();
+    j.entry[start] = (jit_block_fn)code;
+    j.block_end[start] = end;
+    j.block_len[start] = count;
+    cover(j, start, end, true);
+    return j.entry[start];
+}
+
+int jit_init(Chip8Machine &m)
+{
+    if (m.jit != NULL)
+    {
+        return 0;
+    }
+    jit_state *j = new jit_state();
+    // mapped writable only - build_block makes each block's pages executable
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        printf("%s","JIT: could not map code memory, interpreting\n");
+        delete j;
+        return 1;
+    }
+    j->code = (unsigned char*)code;
+    j->used = 0;
+    // find out now if the host lets pages be made executable (some refuse)
+    if (code_protect(*j, 0, 1, PROT_READ | PROT_EXEC) != 0 || code_protect(*j, 0, 1, PROT_READ | PROT_WRITE) != 0)
+    {
+        printf("%s","JIT: could not make code memory executable, interpreting\n");
+        munmap(code, JIT_CODE_SIZE);
+        delete j;
+        return 1;
+    }
+    m.jit = j;
+    return 0;
+}
+
+void jit_close(Chip8Machine &m)
+{
+    if (m.jit == NULL)
+    {
+        return;
+    }
+    munmap(m.jit->code, JIT_CODE_SIZE);
+    delete m.jit;
+    m.jit = NULL;
+}
+
+int jit_run(Chip8Machine &m, unsigned long end_cycle)
+{
+    jit_state &j = *m.jit;
+    while (m.cycles < end_cycle)
+    {
+        unsigned short pc = m.PC;
+        // PCs past the end of RAM wrap in the interpreter; leave them to it
+        if (pc < RAM_SIZE)
+        {
+            jit_block_fn fn = j.entry[pc];
+            if (fn == NULL)
+            {
+                fn = build_block(m, pc);
+            }
+            if (fn != NULL && j.block_len[pc] <= end_cycle - m.cycles)
+            {
+                j.stale = 0;
+                int status = fn(&m);
+                if (status != 0)
+                {
+                    return status;
+                }
+                // a block ending in a short jump back may close a polling loop
+                unsigned short from = j.block_end[pc] - 2;
+                if ((unsigned short)(from - m.PC) <= 2 * (IDLE_MAX_BODY - 1) && m.idle_skip &&
+                    from != m.idle_bad && m.DCACHE[from].variant == V_1NNN)
+                {
+                    CPU_idle_check(m, from);
+                }
+                continue;
+            }
+        }
+        int status = CPU_cycle(m);
+        if (status != 0)
+        {
+            return status;
+        }
+    }
+    return 0;
+}
+
+void jit_invalidate(Chip8Machine &m, unsigned short addr, unsigned int len)
+{
+    jit_state &j = *m.jit;
+    int last = (int)addr + (int)len;
+    if (last > RAM_SIZE)
+    {
+        last = RAM_SIZE;
+    }
+    // stores to data (the usual case) miss every block
+    if (!covers(j, addr, last))
+    {
+        return;
+    }
+    // any block starting up to one maximum block length before the write may cover it
+    int first = (int)addr - 2 * JIT_MAX_BLOCK;
+    if (first < 0)
+    {
+        first = 0;
+    }
+    int dropped_end = last;
+    for (int s = first; s < last; s++)
+    {
+        if (j.entry[s] != NULL && j.block_end[s] > addr)
+        {
+            j.entry[s] = NULL;
+            cover(j, s, j.block_end[s], false);
+            if (j.block_end[s] > dropped_end)
+            {
+                dropped_end = j.block_end[s];
+            }
+            j.stale = 1;
+        }
+    }
+    // blocks that are left may overlap the ones dropped - mark them again
+    int from = first - 2 * JIT_MAX_BLOCK;
+    for (int s = from < 0 ? 0 : from; s < dropped_end; s++)
+    {
+        if (j.entry[s] != NULL && j.block_end[s] > first)
+        {
+            cover(j, s, j.block_end[s], true);
+        }
+    }
+}
+
+void jit_invalidate_all(Chip8Machine &m)
+{
+    jit_state &j = *m.jit;
+    for (int s = 0; s < RAM_SIZE; s++)
+    {
+        j.entry[s] = NULL;
+    }
+    memset(j.covered, 0, sizeof(j.covered));
+    j.stale = 1;
+}
+
+#else
+
+// no recompiler on this host - machines keep interpreting
+
+int jit_init(Chip8Machine &m)
+{
+    printf("%s","JIT: not supported on this host, interpreting\n");
+    return 1;
+}
+
+void jit_close(Chip8Machine &m)
+{
+}
+
+int jit_run(Chip8Machine &m, unsigned long end_cycle)
+{
+    while (m.cycles < end_cycle)
+    {
+        int status = CPU_cycle(m);
+        if (status != 0)
+        {
+            return status;
+        }
+    }
+    return 0;
+}
+
+void jit_invalidate(Chip8Machine &m, unsigned short addr, unsigned int len)
+{
+}
+
+void jit_invalidate_all(Chip8Machine &m)
+{
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef JIT_H
+#define JIT_H
+
+// optional basic-block recompiler for the CPU core (x86-64 Linux only)
+// translates runs of chip8 instructions into native code; anything it does not
+// translate runs through the normal op handlers, so it passes the same ROMs
+#include "cpu.h"
+
+// attach a recompiler to a machine (call after init_CPU)
+// returns non-zero if the host does not support it - the machine keeps interpreting
+int jit_init(Chip8Machine &m);
+
+// detach and free the machine's recompiler
+void jit_close(Chip8Machine &m);
+
+// run compiled blocks until the machine has executed end_cycle instructions in total
+// blocks that would overshoot end_cycle are interpreted one instruction at a time
+int jit_run(Chip8Machine &m, unsigned long end_cycle);
+
+// drop compiled blocks covering a RAM write of len bytes at addr (self-modifying code)
+void jit_invalidate(Chip8Machine &m, unsigned short addr, unsigned int len);
+
+// drop every compiled block
+void jit_invalidate_all(Chip8Machine &m);
+
+#endif
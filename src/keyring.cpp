@@ -0,0 +1,149 @@
+// lock-free SPSC key event queue (see keyring.h)
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "keyring.h"
+
+bool key_ring_init(key_ring &ring)
+{
+    ring.head.store(0);
+    ring.tail.store(0);
+    ring.held = 0;
+    ring.release = 0;
+    // non-blocking, so the consumer can clear it without waiting
+    ring.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring.wake_fd < 0)
+    {
+        printf("%s","WARNING: could not create the key event fd, FX0A waits will poll\n");
+        return false;
+    }
+    return true;
+}
+
+bool key_ring_push(key_ring &ring, const key_event &ev)
+{
+    unsigned int head = ring.head.load(std::memory_order_relaxed);
+    // acquire pairs with the consumer's release, so the slot is free before we write it
+    if (head - ring.tail.load(std::memory_order_acquire) == KEY_RING_SIZE)
+    {
+        return false;
+    }
+    ring.events[head & (KEY_RING_SIZE - 1)] = ev;
+    // publish the event, then wake the consumer if it is waiting
+    ring.head.store(head + 1, std::memory_order_release);
+    key_ring_wake(ring);
+    return true;
+}
+
+void key_ring_wake(key_ring &ring)
+{
+    if (ring.wake_fd >= 0)
+    {
+        uint64_t one = 1;
+        // a full counter already means "wake up", so a failed write loses nothing
+        ssize_t written = write(ring.wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+bool key_ring_wait(key_ring &ring, int timeout_ms)
+{
+    if (ring.wake_fd < 0)
+    {
+        struct timespec sleep = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        nanosleep(&sleep, NULL);
+        return ring.tail.load(std::memory_order_relaxed) != ring.head.load(std::memory_order_acquire);
+    }
+    // clear wakeups for events already taken, then only sleep if nothing is queued
+    // (a push after the check writes the fd again, so poll sees it)
+    uint64_t count;
+    ssize_t got = read(ring.wake_fd, &count, sizeof(count));
+    (void)got;
+    if (ring.tail.load(std::memory_order_relaxed) != ring.head.load(std::memory_order_acquire))
+    {
+        return true;
+    }
+    struct pollfd fd = {ring.wake_fd, POLLIN, 0};
+    return poll(&fd, 1, timeout_ms) > 0;
+}
+
+bool key_ring_pop(key_ring &ring, key_event &ev)
+{
+    unsigned int tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail == ring.head.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    ev = ring.events[tail & (KEY_RING_SIZE - 1)];
+    // hand the slot back to the producer
+    ring.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool key_ring_peek(key_ring &ring, key_event &ev)
+{
+    unsigned int tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail == ring.head.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    ev = ring.events[tail & (KEY_RING_SIZE - 1)];
+    return true;
+}
+
+unsigned int key_ring_apply(key_ring &ring, Chip8Machine &m, unsigned long until)
+{
+    key_event ev;
+    unsigned int commands = 0;
+    // let go of the taps held down through the last burst
+    for (int i = 0; i < 16; i++)
+    {
+        if (ring.release & (1u << i))
+        {
+            m.KEYS[i] = 0;
+        }
+    }
+    ring.release = 0;
+    // keys pressed in this batch
+    unsigned int pressed = 0;
+    while (key_ring_peek(ring, ev) && ev.stamp < until)
+    {
+        key_ring_pop(ring, ev);
+        if (ev.key >= KEY_CMD_BASE)
+        {
+            if (ev.state == 1)
+            {
+                commands = commands | KEY_CMD_BIT(ev.key);
+                ring.held = ring.held | KEY_CMD_BIT(ev.key);
+            }
+            else
+            {
+                ring.held = ring.held & ~KEY_CMD_BIT(ev.key);
+            }
+        }
+        else if (ev.state == 1)
+        {
+            m.KEYS[ev.key] = 1;
+            pressed = pressed | (1u << ev.key);
+            ring.release = ring.release & ~(1u << ev.key);
+        }
+        else if (pressed & (1u << ev.key))
+        {
+            // released before an instruction ran - keep it down until the next batch
+            ring.release = ring.release | (1u << ev.key);
+        }
+        else
+        {
+            m.KEYS[ev.key] = 0;
+        }
+    }
+    return commands;
+}
+
+unsigned long key_stamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
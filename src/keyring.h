@@ -0,0 +1,88 @@
+#ifndef KEYRING_H
+#define KEYRING_H
+
+// lock-free single-producer/single-consumer queue of key events
+// the input thread pushes SDL key changes stamped with the time it saw them, the
+// CPU thread pops them at instruction boundaries, so only the CPU thread ever
+// writes the machine's KEYS
+// each push also signals an eventfd, so a CPU thread with nothing to do until
+// the next key (FX0A) can sleep on it instead of polling
+#include <atomic>
+#include "cpu.h"
+
+// number of queued events (must be a power of 2)
+#define KEY_RING_SIZE 256
+
+// host commands (hotkeys) ride the same queue as keypad changes, as keys
+// from KEY_CMD_BASE up; key_ring_apply hands them back as a bit mask
+#define KEY_CMD_BASE 16
+// F5 = save state
+#define KEY_CMD_SAVE 16
+// F9 = load state
+#define KEY_CMD_LOAD 17
+// Backspace (held) = rewind
+#define KEY_CMD_REWIND 18
+// Tab = fast-forward on/off
+#define KEY_CMD_FASTFWD 19
+// bit for a command in key_ring_apply's result
+#define KEY_CMD_BIT(cmd) (1u << ((cmd) - KEY_CMD_BASE))
+
+// one key change on the chip8 keypad (or a host command)
+struct key_event
+{
+    // CLOCK_MONOTONIC time the host saw the event, in ns (key_stamp)
+    unsigned long stamp;
+    // chip8 key (0-F) or host command (KEY_CMD_*)
+    unsigned char key;
+    // 1 = down, 0 = up
+    unsigned char state;
+};
+
+struct key_ring
+{
+    key_event events[KEY_RING_SIZE];
+    // next slot to write (only the producer stores it)
+    std::atomic<unsigned int> head;
+    // next slot to read (only the consumer stores it)
+    std::atomic<unsigned int> tail;
+    // host commands currently held down, as KEY_CMD_BIT bits (consumer side only)
+    unsigned int held;
+    // keypad keys released in the same batch they were pressed in, let go of by
+    // the next key_ring_apply (consumer side only)
+    unsigned int release;
+    // eventfd written on every push (and by key_ring_wake)
+    int wake_fd;
+};
+
+// empty the ring and open its eventfd (call before either thread uses it)
+// returns false if the eventfd can't be created (key_ring_wait then just sleeps)
+bool key_ring_init(key_ring &ring);
+
+// producer side: queue an event, returns false if the ring is full (the event is dropped)
+bool key_ring_push(key_ring &ring, const key_event &ev);
+
+// consumer side: take the oldest event, returns false if the ring is empty
+bool key_ring_pop(key_ring &ring, key_event &ev);
+
+// consumer side: the oldest event, without taking it
+bool key_ring_peek(key_ring &ring, key_event &ev);
+
+// wake a consumer blocked in key_ring_wait without queuing anything (e.g. on shutdown)
+void key_ring_wake(key_ring &ring);
+
+// consumer side: block until an event is queued, key_ring_wake is called or
+// timeout_ms passes; returns false on a timeout
+bool key_ring_wait(key_ring &ring, int timeout_ms);
+
+// consumer side: apply the queued key events stamped before until to the
+// machine's keypad (events stamped later stay queued)
+// a key pressed and released within one batch stays down until the next call,
+// so the program gets at least one instruction to see a short tap
+// returns the host commands that were pressed, as KEY_CMD_BIT bits
+// (ring.held tracks which ones are still down)
+unsigned int key_ring_apply(key_ring &ring, Chip8Machine &m, unsigned long until);
+
+// CLOCK_MONOTONIC now in ns, for stamping events
+unsigned long key_stamp();
+
+#endif
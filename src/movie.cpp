@@ -0,0 +1,224 @@
+// movie recording and replay (see movie.h)
+#include <time.h>
+#include "movie.h"
+#include "jit.h"
+
+uint64_t movie_rom_hash(const Chip8Machine &m)
+{
+    uint64_t hash = 14695981039346656037UL;
+    for (int i = 0; i < RAM_SIZE; i++)
+    {
+        hash = (hash ^ m.RAM[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+// LEB128-style variable length integer
+static void write_varint(FILE *file, unsigned long value)
+{
+    while (value >= 0x80)
+    {
+        fputc((int)((value & 0x7F) | 0x80), file);
+        value = value >> 7;
+    }
+    fputc((int)value, file);
+}
+
+// returns non-zero at end of file or on a malformed value
+static int read_varint(FILE *file, unsigned long &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift = shift + 7)
+    {
+        int c = fgetc(file);
+        if (c == EOF)
+        {
+            return 1;
+        }
+        value = value | ((unsigned long)(c & 0x7F) << shift);
+        if ((c & 0x80) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int movie_record_start(movie_recorder &rec, const char *filename, const Chip8Machine &m, uint64_t seed,
+    unsigned long tick_cycles)
+{
+    rec.file = fopen(filename, "wb");
+    if (rec.file == NULL)
+    {
+        printf("ERROR: could not open movie %s\n", filename);
+        return 1;
+    }
+    movie_header header = {MOVIE_MAGIC, MOVIE_VERSION, (uint32_t)tick_cycles, 0, seed, movie_rom_hash(m)};
+    fwrite(&header, sizeof(header), 1, rec.file);
+    rec.last_cycle = m.cycles;
+    memcpy(rec.keys, m.KEYS, sizeof(rec.keys));
+    rec.records = 0;
+    printf("Recording movie to %s (seed %lu)\n", filename, (unsigned long)seed);
+    return 0;
+}
+
+void movie_record_keys(movie_recorder &rec, const Chip8Machine &m)
+{
+    if (memcmp(rec.keys, m.KEYS, sizeof(rec.keys)) == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        if (rec.keys[i] != m.KEYS[i])
+        {
+            write_varint(rec.file, m.cycles - rec.last_cycle);
+            fputc(i | (m.KEYS[i] ? 1 : 0) << 4, rec.file);
+            rec.keys[i] = m.KEYS[i];
+            rec.last_cycle = m.cycles;
+            rec.records = rec.records + 1;
+        }
+    }
+}
+
+int movie_record_stop(movie_recorder &rec, const Chip8Machine &m)
+{
+    write_varint(rec.file, m.cycles - rec.last_cycle);
+    fputc(MOVIE_END, rec.file);
+    uint64_t sum = headless_checksum(m);
+    fwrite(&sum, sizeof(sum), 1, rec.file);
+    long size = ftell(rec.file);
+    int status = fclose(rec.file);
+    rec.file = NULL;
+    if (status != 0)
+    {
+        printf("%s","ERROR: could not write movie\n");
+        return 1;
+    }
+    printf("Recorded %lu key changes over %lu cycles in %ld bytes (final checksum %016lx)\n",
+        rec.records, m.cycles, size, (unsigned long)sum);
+    return 0;
+}
+
+int movie_load(movie &mv, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        printf("ERROR: could not open movie %s\n", filename);
+        return 1;
+    }
+    if (fread(&mv.header, sizeof(mv.header), 1, file) != 1 || mv.header.magic != MOVIE_MAGIC)
+    {
+        printf("ERROR: %s is not a chip8 movie\n", filename);
+        fclose(file);
+        return 1;
+    }
+    if (mv.header.version != MOVIE_VERSION)
+    {
+        printf("ERROR: movie version %u is not supported (this build reads version %u)\n",
+            mv.header.version, MOVIE_VERSION);
+        fclose(file);
+        return 1;
+    }
+    if (mv.header.tick_cycles == 0)
+    {
+        printf("ERROR: movie %s has a corrupt header (0 cycles per timer tick)\n", filename);
+        fclose(file);
+        return 1;
+    }
+    mv.events.events.clear();
+    mv.events.pos = 0;
+    mv.has_end = false;
+    unsigned long cycle = 0;
+    unsigned long delta;
+    while (read_varint(file, delta) == 0)
+    {
+        cycle = cycle + delta;
+        int c = fgetc(file);
+        if (c == MOVIE_END)
+        {
+            mv.has_end = fread(&mv.checksum, sizeof(mv.checksum), 1, file) == 1;
+            mv.end_cycle = cycle;
+            break;
+        }
+        if (c == EOF)
+        {
+            break;
+        }
+        // key 0-F in the low nibble, up or down in bit 4 - anything else is damage
+        if (c > 0x1F)
+        {
+            printf("ERROR: movie %s has a corrupt record at cycle %lu\n", filename, cycle);
+            fclose(file);
+            return 1;
+        }
+        mv.events.events.push_back({cycle, (unsigned char)(c & 0x0F), (unsigned char)(c >> 4)});
+    }
+    fclose(file);
+    if (!mv.has_end)
+    {
+        printf("WARNING: movie %s has no end record (recording cut off?)\n", filename);
+        mv.end_cycle = cycle;
+    }
+    printf("Loaded movie: %d key changes over %lu cycles, seed %lu\n", (int)mv.events.events.size(),
+        mv.end_cycle, (unsigned long)mv.header.seed);
+    return 0;
+}
+
+int movie_replay(char *fval, const char *filename, bool jit)
+{
+    movie mv;
+    if (movie_load(mv, filename) != 0)
+    {
+        return 1;
+    }
+    int xval = 0;
+    Chip8Machine *m = new Chip8Machine();
+    if (init_CPU(*m, xval, fval, &NULL_IO) != 0)
+    {
+        delete m;
+        return 1;
+    }
+    if (movie_rom_hash(*m) != mv.header.rom_hash)
+    {
+        printf("ERROR: movie %s was recorded with a different ROM\n", filename);
+        delete m;
+        return 1;
+    }
+    CPU_seed(*m, mv.header.seed);
+    if (jit)
+    {
+        jit_init(*m);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_machine_headless(*m, mv.events, mv.end_cycle, mv.header.tick_cycles, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    // emulated time at 60 timer ticks per second, against the time the replay took
+    double emulated = (double)m->cycles / mv.header.tick_cycles / 60;
+    printf("replay finished: %lu cycles in %.3f s (%.1f s emulated, %.0fx real time)\n", m->cycles, secs,
+        emulated, secs > 0 ? emulated / secs : 0.0);
+
+    uint64_t sum = headless_checksum(*m);
+    printf("final state checksum: %016lx\n", (unsigned long)sum);
+    int status = 0;
+    if (mv.has_end)
+    {
+        if (m->cycles == mv.end_cycle && sum == mv.checksum)
+        {
+            printf("%s","replay matches the recording\n");
+        }
+        else
+        {
+            printf("MISMATCH: recording ended on cycle %lu with checksum %016lx\n", mv.end_cycle,
+                (unsigned long)mv.checksum);
+            status = 1;
+        }
+    }
+    jit_close(*m);
+    delete m;
+    return status;
+}
@@ -0,0 +1,83 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+// movie files: record a run's random seed and keypad changes, replay it bit-exactly
+// a run only depends on the ROM, the seed, the timer tick length and the cycle
+// each key change landed on, so that is all a movie stores
+//
+// file layout (host byte order):
+//   movie_header
+//   one record per key change: varint cycles since the previous record, then
+//     one byte (key | state << 4)
+//   end record: varint cycles to the end of the run, MOVIE_END, then the
+//     64-bit state checksum (headless_checksum) the run finished with
+#include <stdio.h>
+#include "headless.h"
+
+// "C8MV" file magic
+#define MOVIE_MAGIC 0x564D3843
+// version 2: 64-bit seed for the per-machine generator
+// version 3: initial RAM (rom_hash) holds the SUPER-CHIP big font
+#define MOVIE_VERSION 3
+// marks the end record
+#define MOVIE_END 0xFF
+
+struct movie_header
+{
+    uint32_t magic;
+    uint32_t version;
+    // instructions per 60Hz timer tick (the timers run on the virtual clock)
+    uint32_t tick_cycles;
+    uint32_t reserved;
+    // value the machine's random number generator was seeded with (CPU_seed)
+    uint64_t seed;
+    // checksum of RAM after init_CPU, to catch replays against another ROM
+    uint64_t rom_hash;
+};
+
+// a movie being written
+struct movie_recorder
+{
+    FILE *file;
+    // cycle of the last record
+    unsigned long last_cycle;
+    // keypad as of the last record
+    unsigned char keys[16];
+    unsigned long records;
+};
+
+// a loaded movie
+struct movie
+{
+    movie_header header;
+    // key changes, as an input script for run_machine_headless
+    input_script events;
+    // cycle the recorded run ended on and its final checksum (has_end = false if
+    // the recording was cut off, e.g. by a crash)
+    bool has_end;
+    unsigned long end_cycle;
+    uint64_t checksum;
+};
+
+// checksum of a freshly initialised machine's RAM (the movie's rom_hash)
+uint64_t movie_rom_hash(const Chip8Machine &m);
+
+// start recording a machine that has just been initialised and seeded
+int movie_record_start(movie_recorder &rec, const char *filename, const Chip8Machine &m, uint64_t seed,
+    unsigned long tick_cycles);
+
+// record any keypad changes since the last call, at the machine's current cycle
+// (call after new key state is applied and before the next instruction runs)
+void movie_record_keys(movie_recorder &rec, const Chip8Machine &m);
+
+// write the end record and close the file
+int movie_record_stop(movie_recorder &rec, const Chip8Machine &m);
+
+// load a movie file
+int movie_load(movie &mv, const char *filename);
+
+// replay a movie headless as fast as possible on the ROM in fval
+// prints the final checksum and returns non-zero if it differs from the recording
+int movie_replay(char *fval, const char *filename, bool jit);
+
+#endif
@@ -0,0 +1,111 @@
+// instrumentation counters and the histogram dump (see profile.h)
+#include "profile.h"
+
+#ifdef CHIP8_PROFILE
+#include <signal.h>
+#include <algorithm>
+
+// executions per opcode variant
+unsigned long PROFILE_VARIANTS[V_COUNT];
+
+// handler call counts and sampled cost
+profile_slot PROFILE_HANDLERS[PROFILE_SLOTS];
+
+// set by the SIGUSR1 handler
+volatile sig_atomic_t profile_requested = 0;
+
+// names of the opcode variants, in op_variant order
+const char *VARIANT_NAMES[V_COUNT] = {
+    "(none)", "NULL",
+    "00E0", "00EE", "0NNN",
+    "00CN", "00DN", "00FB", "00FC", "00FD", "00FE", "00FF",
+    "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+    "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7", "8XYE",
+    "9XY0", "ANNN", "BNNN", "CXNN", "DXYN",
+    "EX9E", "EXA1",
+    "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65",
+    "FX30", "FX75", "FX85",
+    "NOP"};
+
+// names of the handler slots
+const char *SLOT_NAMES[PROFILE_SLOTS] = {
+    "op0", "op1", "op2", "op3", "op4", "op5", "op6", "op7",
+    "op8", "op9", "op10", "op11", "op12", "op13", "op14", "op15",
+    "draw_screen_vector"};
+
+// bar of up to 40 #s for a share of the total
+void print_bar(FILE *out, double share)
+{
+    int len = (int)(share * 40 + 0.5);
+    for (int i = 0; i < len; i++)
+    {
+        fputc('#', out);
+    }
+    fputc('\n', out);
+}
+
+// estimated total ticks spent in a handler slot (sampled average * calls)
+double slot_total(int slot)
+{
+    const profile_slot &ps = PROFILE_HANDLERS[slot];
+    if (ps.samples == 0)
+    {
+        return 0;
+    }
+    return (double)ps.ticks / ps.samples * ps.calls;
+}
+
+void profile_dump(FILE *out)
+{
+    // variants by execution count
+    int order[V_COUNT];
+    unsigned long total = 0;
+    for (int i = 0; i < V_COUNT; i++)
+    {
+        order[i] = i;
+        total = total + PROFILE_VARIANTS[i];
+    }
+    std::sort(order, order + V_COUNT, [](int a, int b) { return PROFILE_VARIANTS[a] > PROFILE_VARIANTS[b]; });
+    fprintf(out, "==== opcode profile: %lu instructions ====\n", total);
+    fprintf(out, "%-8s %14s %7s\n", "variant", "count", "share");
+    for (int i = 0; i < V_COUNT && PROFILE_VARIANTS[order[i]] > 0; i++)
+    {
+        double share = total > 0 ? (double)PROFILE_VARIANTS[order[i]] / total : 0.0;
+        fprintf(out, "%-8s %14lu %6.2f%% ", VARIANT_NAMES[order[i]], PROFILE_VARIANTS[order[i]], share * 100);
+        print_bar(out, share);
+    }
+
+    // handlers by estimated total cost
+    int slots[PROFILE_SLOTS];
+    double cost = 0;
+    for (int i = 0; i < PROFILE_SLOTS; i++)
+    {
+        slots[i] = i;
+        cost = cost + slot_total(i);
+    }
+    std::sort(slots, slots + PROFILE_SLOTS, [](int a, int b) { return slot_total(a) > slot_total(b); });
+    fprintf(out, "==== handler cost (1 in %d calls timed, host ticks) ====\n", PROFILE_SAMPLE);
+    fprintf(out, "%-18s %14s %12s %7s\n", "handler", "calls", "avg ticks", "share");
+    for (int i = 0; i < PROFILE_SLOTS && PROFILE_HANDLERS[slots[i]].calls > 0; i++)
+    {
+        const profile_slot &ps = PROFILE_HANDLERS[slots[i]];
+        double share = cost > 0 ? slot_total(slots[i]) / cost : 0.0;
+        fprintf(out, "%-18s %14lu %12.1f %6.2f%% ", SLOT_NAMES[slots[i]], ps.calls,
+            ps.samples > 0 ? (double)ps.ticks / ps.samples : 0.0, share * 100);
+        print_bar(out, share);
+    }
+    fflush(out);
+}
+
+// SIGUSR1 handler - only sets a flag, the run loop does the printing
+void profile_signal(int sig)
+{
+    profile_requested = 1;
+}
+
+void profile_install_signal()
+{
+    signal(SIGUSR1, profile_signal);
+}
+
+#endif
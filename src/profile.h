@@ -0,0 +1,100 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// optional instrumentation for the CPU core
+// build with -DCHIP8_PROFILE (make all PROFILE=1) to count executions per opcode
+// variant and sample the host cycle cost of each handler (op0 - op15, plus
+// draw_screen_vector). without it every PROFILE_* macro compiles to nothing
+// counters are process-wide, so profile one machine per process
+#include <stdio.h>
+#include "cpu.h"
+
+// handler slots: op0 - op15 by first opcode nibble, then the SDL draw
+#define PROFILE_DRAW 16
+#define PROFILE_SLOTS 17
+
+// one in every PROFILE_SAMPLE calls of a handler is timed (must be a power of 2)
+#define PROFILE_SAMPLE 64
+
+#ifdef CHIP8_PROFILE
+#include <signal.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+// host cycle counter
+static inline unsigned long profile_ticks()
+{
+    return __rdtsc();
+}
+#else
+// no cycle counter - fall back to monotonic nanoseconds
+static inline unsigned long profile_ticks()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+#endif
+
+// per handler call counts and sampled cost
+struct profile_slot
+{
+    unsigned long calls;
+    unsigned long samples;
+    unsigned long ticks;
+};
+
+// executions per opcode variant (op_variant)
+extern unsigned long PROFILE_VARIANTS[V_COUNT];
+
+// handler slots (see PROFILE_DRAW)
+extern profile_slot PROFILE_HANDLERS[PROFILE_SLOTS];
+
+// set by the SIGUSR1 handler, cleared once the histogram is printed
+extern volatile sig_atomic_t profile_requested;
+
+// count one execution of an opcode variant
+#define PROFILE_COUNT(variant) (PROFILE_VARIANTS[(variant)]++)
+
+// run call, timing it on every PROFILE_SAMPLE'th use of the handler slot
+#define PROFILE_CALL(slot, call) \
+    do { \
+        profile_slot &ps_ = PROFILE_HANDLERS[(slot)]; \
+        if ((ps_.calls++ & (PROFILE_SAMPLE - 1)) == 0) \
+        { \
+            unsigned long t0_ = profile_ticks(); \
+            call; \
+            ps_.ticks += profile_ticks() - t0_; \
+            ps_.samples++; \
+        } \
+        else \
+        { \
+            call; \
+        } \
+    } while (0)
+
+// print the histogram if SIGUSR1 asked for it (call from the run loops)
+#define PROFILE_POLL() \
+    do { \
+        if (profile_requested) \
+        { \
+            profile_requested = 0; \
+            profile_dump(stdout); \
+        } \
+    } while (0)
+
+// print the sorted variant and handler histograms
+void profile_dump(FILE *out);
+
+// print the histogram on SIGUSR1 (at the next PROFILE_POLL)
+void profile_install_signal();
+
+#else
+
+#define PROFILE_COUNT(variant) ((void)0)
+#define PROFILE_CALL(slot, call) do { call; } while (0)
+#define PROFILE_POLL() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,117 @@
+// render stage: triple buffer between the CPU thread and the render thread
+#include <string.h>
+#include "render.h"
+
+// frames published by RENDER_IO, read by the render thread
+triple_buffer RENDER_FRAMES;
+
+// frame skipping state (CPU thread only)
+static bool render_skip = false;
+// a draw was skipped since the last publish
+static bool render_pending = false;
+// mode of the last published frame, for blank frames from clears
+static uint32_t render_hires = 0;
+
+// reset a triple buffer to three blank frames
+void triple_init(triple_buffer &tb)
+{
+    memset(tb.frames, 0, sizeof(tb.frames));
+    tb.back = 0;
+    tb.middle.store(1);
+    tb.front = 2;
+}
+
+// copy the rows of the current mode (a lo-res frame is half the copy)
+// a row at a time: one 16 byte move each, where memcpy would start a rep movs
+static inline void copy_frame(display_buffer &to, const display_buffer &from)
+{
+    to.hires = from.hires;
+    int height = display_height(from);
+    for (int i = 0; i < height; i++)
+    {
+        memcpy(to.rows[i], from.rows[i], sizeof(to.rows[i]));
+    }
+}
+
+// writer side: copy a frame in and make it the newest one
+void triple_publish(triple_buffer &tb, const display_buffer &screen)
+{
+    copy_frame(tb.frames[tb.back], screen);
+    // swap the filled slot into the middle and take the old middle slot back
+    // (release makes the frame visible before the index, acquire gets the old
+    // slot only once the reader has finished with it)
+    unsigned int prev = tb.middle.exchange(tb.back | TRIPLE_FRESH, std::memory_order_acq_rel);
+    tb.back = prev & 3;
+}
+
+// reader side: take the newest frame if there is one
+bool triple_take(triple_buffer &tb, display_buffer &screen)
+{
+    if ((tb.middle.load(std::memory_order_relaxed) & TRIPLE_FRESH) == 0)
+    {
+        return false;
+    }
+    // swap the slot we were reading into the middle (clearing the fresh bit)
+    unsigned int prev = tb.middle.exchange(tb.front, std::memory_order_acq_rel);
+    tb.front = prev & 3;
+    copy_frame(screen, tb.frames[tb.front]);
+    return true;
+}
+
+// CPU side backend functions
+bool render_screen_init(int &xval)
+{
+    // the render thread opens the real screen (RENDER_FRAMES is set up by main)
+    return true;
+}
+
+void render_screen_close()
+{
+}
+
+int render_clear_screen()
+{
+    if (render_skip)
+    {
+        render_pending = true;
+        return 0;
+    }
+    // 00E0 has already blanked the machine's display - publish a blank frame
+    static display_buffer blank;
+    blank.hires = render_hires;
+    triple_publish(RENDER_FRAMES, blank);
+    return 0;
+}
+
+int render_draw_screen(const display_buffer &screen, uint64_t dirty_rows)
+{
+    // the render thread works out its own dirty rows against what it last drew,
+    // since it may skip frames the CPU published in between
+    render_hires = screen.hires;
+    if (render_skip)
+    {
+        render_pending = true;
+        return 0;
+    }
+    triple_publish(RENDER_FRAMES, screen);
+    return 0;
+}
+
+void render_set_skip(bool skip)
+{
+    render_skip = skip;
+}
+
+bool render_flush(const display_buffer &screen)
+{
+    if (!render_pending)
+    {
+        return false;
+    }
+    render_pending = false;
+    triple_publish(RENDER_FRAMES, screen);
+    return true;
+}
+
+// display backend for the CPU thread
+const io_backend RENDER_IO = {render_screen_init, render_screen_close, render_clear_screen, render_draw_screen};
@@ -0,0 +1,55 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+// render stage: hands finished frames from the CPU thread to the render thread
+// the CPU publishes into a lock-free triple buffer and never waits on the renderer;
+// the render thread presents the newest frame at the display refresh rate
+// this header does not pull in SDL
+#include <atomic>
+#include "iobackend.h"
+
+// three frame slots - the CPU owns one (back), the renderer owns one (front)
+// and the third (middle) holds the newest published frame
+struct triple_buffer
+{
+    display_buffer frames[3];
+    // index of the middle slot, plus TRIPLE_FRESH when it holds an unread frame
+    std::atomic<unsigned int> middle;
+    // slot the writer fills next
+    unsigned int back;
+    // slot the reader last took
+    unsigned int front;
+};
+
+// set on triple_buffer.middle when the middle slot holds a frame the reader has not taken
+#define TRIPLE_FRESH 4
+
+// reset a triple buffer to three blank frames
+void triple_init(triple_buffer &tb);
+
+// writer side: copy a frame in and make it the newest one (never blocks)
+void triple_publish(triple_buffer &tb, const display_buffer &screen);
+
+// reader side: if a new frame was published since the last take, copy it out
+// returns true if screen was updated
+bool triple_take(triple_buffer &tb, display_buffer &screen);
+
+// frame skipping (fast-forward/turbo): while skip is on, RENDER_IO draws only note
+// that the screen changed, and the CPU thread publishes the display itself with
+// render_flush at whatever rate it wants to present
+// both are CPU thread only
+void render_set_skip(bool skip);
+
+// publish the screen if any draws were skipped since the last publish
+// returns true if a frame was published
+bool render_flush(const display_buffer &screen);
+
+// frames published by RENDER_IO, read by the render thread
+// triple_init it before starting the CPU and render threads
+extern triple_buffer RENDER_FRAMES;
+
+// display backend for the CPU thread: draws and clears publish into RENDER_FRAMES
+// (the render thread owns the actual screen)
+extern const io_backend RENDER_IO;
+
+#endif
@@ -0,0 +1,287 @@
+// rewind history of XOR + run-length encoded frame deltas (see rewind.h)
+#include <stdio.h>
+#include <stdlib.h>
+#include "rewind.h"
+
+// bytes in a snapshot, the unit the deltas cover
+#define REWIND_SNAP_SIZE sizeof(chip8_snapshot)
+
+// worst case encoded size: a token header for every couple of bytes
+#define REWIND_SCRATCH_SIZE (2 * REWIND_SNAP_SIZE + 16)
+
+// a literal run only ends at this many unchanged bytes in a row
+// (shorter gaps cost less as literal bytes than as another token)
+#define REWIND_MIN_RUN 4
+
+static_assert(REWIND_SNAP_SIZE % 8 == 0, "snapshot size must be a multiple of 8");
+
+// LEB128-style variable length integers for run lengths
+static size_t put_varint(unsigned char *out, size_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        out[n] = (unsigned char)(value | 0x80);
+        value = value >> 7;
+        n = n + 1;
+    }
+    out[n] = (unsigned char)value;
+    return n + 1;
+}
+
+static size_t get_varint(const unsigned char *in, size_t &value)
+{
+    size_t n = 0;
+    int shift = 0;
+    value = 0;
+    while (in[n] & 0x80)
+    {
+        value = value | ((size_t)(in[n] & 0x7F) << shift);
+        shift = shift + 7;
+        n = n + 1;
+    }
+    value = value | ((size_t)in[n] << shift);
+    return n + 1;
+}
+
+// encode a XOR b as a list of (unchanged run, literal run, literal XOR bytes) tokens
+// returns the encoded length
+static size_t delta_encode(const unsigned char *a, const unsigned char *b, unsigned char *out)
+{
+    size_t pos = 0;
+    size_t len = 0;
+    while (pos < REWIND_SNAP_SIZE)
+    {
+        // skip unchanged bytes, a word at a time where possible
+        size_t start = pos;
+        while (pos + 8 <= REWIND_SNAP_SIZE)
+        {
+            uint64_t wa, wb;
+            memcpy(&wa, a + pos, 8);
+            memcpy(&wb, b + pos, 8);
+            if (wa != wb)
+            {
+                break;
+            }
+            pos = pos + 8;
+        }
+        while (pos < REWIND_SNAP_SIZE && a[pos] == b[pos])
+        {
+            pos = pos + 1;
+        }
+        size_t zeros = pos - start;
+        // take changed bytes until REWIND_MIN_RUN unchanged ones in a row
+        size_t lit = pos;
+        size_t same = 0;
+        while (lit < REWIND_SNAP_SIZE && same < REWIND_MIN_RUN)
+        {
+            same = (a[lit] == b[lit]) ? same + 1 : 0;
+            lit = lit + 1;
+        }
+        if (same > 0)
+        {
+            lit = lit - same;
+        }
+        len = len + put_varint(out + len, zeros);
+        len = len + put_varint(out + len, lit - pos);
+        for (size_t i = pos; i < lit; i++)
+        {
+            out[len] = a[i] ^ b[i];
+            len = len + 1;
+        }
+        pos = lit;
+    }
+    return len;
+}
+
+// XOR an encoded delta into a snapshot
+static void delta_apply(const unsigned char *in, unsigned char *snap)
+{
+    size_t pos = 0;
+    size_t n = 0;
+    while (pos < REWIND_SNAP_SIZE)
+    {
+        size_t zeros, lit;
+        n = n + get_varint(in + n, zeros);
+        n = n + get_varint(in + n, lit);
+        pos = pos + zeros;
+        for (size_t i = 0; i < lit; i++)
+        {
+            snap[pos + i] = snap[pos + i] ^ in[n + i];
+        }
+        pos = pos + lit;
+        n = n + lit;
+    }
+}
+
+int rewind_init(rewind_buffer &r, size_t capacity)
+{
+    r.ring = (unsigned char *)malloc(capacity);
+    r.scratch = (unsigned char *)malloc(REWIND_SCRATCH_SIZE);
+    if (r.ring == NULL || r.scratch == NULL)
+    {
+        printf("ERROR: could not allocate %lu bytes of rewind history\n", (unsigned long)capacity);
+        free(r.ring);
+        free(r.scratch);
+        r.ring = NULL;
+        r.scratch = NULL;
+        return 1;
+    }
+    r.capacity = capacity;
+    r.head = 0;
+    r.tail = 0;
+    r.wrap = SIZE_MAX;
+    r.frames = 0;
+    r.used = 0;
+    r.have_last = false;
+    r.pushed = 0;
+    r.pushed_bytes = 0;
+    r.dropped = 0;
+    return 0;
+}
+
+void rewind_close(rewind_buffer &r)
+{
+    free(r.ring);
+    free(r.scratch);
+    r.ring = NULL;
+    r.scratch = NULL;
+    r.frames = 0;
+}
+
+// frame length stored in the ring at pos
+static size_t get_len(const rewind_buffer &r, size_t pos)
+{
+    uint32_t len;
+    memcpy(&len, r.ring + pos, sizeof(len));
+    return len;
+}
+
+static void put_len(rewind_buffer &r, size_t pos, size_t len)
+{
+    uint32_t n = (uint32_t)len;
+    memcpy(r.ring + pos, &n, sizeof(n));
+}
+
+// an empty history starts again at the bottom of the ring
+static void reset_if_empty(rewind_buffer &r)
+{
+    if (r.frames == 0)
+    {
+        r.head = 0;
+        r.tail = 0;
+        r.wrap = SIZE_MAX;
+    }
+}
+
+// drop the oldest stored frame
+static void drop_oldest(rewind_buffer &r)
+{
+    size_t size = get_len(r, r.tail) + REWIND_FRAME_OVERHEAD;
+    r.used = r.used - size;
+    r.tail = r.tail + size;
+    r.frames = r.frames - 1;
+    r.dropped = r.dropped + 1;
+    // past the last frame before the wrap, the oldest is back at 0
+    if (r.tail == r.wrap)
+    {
+        r.tail = 0;
+        r.wrap = SIZE_MAX;
+    }
+    reset_if_empty(r);
+}
+
+void rewind_push(rewind_buffer &r, const Chip8Machine &m)
+{
+    chip8_snapshot snap;
+    snapshot_take(m, snap);
+    if (!r.have_last)
+    {
+        r.last = snap;
+        r.have_last = true;
+        return;
+    }
+    // the delta turns this frame back into the previous one
+    size_t len = delta_encode((const unsigned char *)&snap, (const unsigned char *)&r.last, r.scratch);
+    r.last = snap;
+    r.pushed = r.pushed + 1;
+    r.pushed_bytes = r.pushed_bytes + len;
+    size_t size = len + REWIND_FRAME_OVERHEAD;
+    if (size > r.capacity)
+    {
+        // can't hold even one frame - history restarts here
+        while (r.frames > 0)
+        {
+            drop_oldest(r);
+        }
+        return;
+    }
+    // frames never wrap: if this one doesn't fit before the end of the ring,
+    // free the (oldest) frames still past head and start again at 0
+    if (r.head + size > r.capacity)
+    {
+        while (r.frames > 0 && r.wrap != SIZE_MAX)
+        {
+            drop_oldest(r);
+        }
+        if (r.frames > 0)
+        {
+            r.wrap = r.head;
+            r.head = 0;
+        }
+    }
+    // free the oldest frames this one overwrites
+    while (r.frames > 0 && r.wrap != SIZE_MAX && r.tail < r.head + size)
+    {
+        drop_oldest(r);
+    }
+    put_len(r, r.head, len);
+    memcpy(r.ring + r.head + sizeof(uint32_t), r.scratch, len);
+    put_len(r, r.head + sizeof(uint32_t) + len, len);
+    r.head = r.head + size;
+    r.frames = r.frames + 1;
+    r.used = r.used + size;
+}
+
+int rewind_step(rewind_buffer &r, Chip8Machine &m)
+{
+    if (r.frames == 0)
+    {
+        return 1;
+    }
+    // the newest frame sits just below head (or below the wrap, if head is back at 0)
+    if (r.head == 0)
+    {
+        r.head = r.wrap;
+        r.wrap = SIZE_MAX;
+    }
+    size_t len = get_len(r, r.head - sizeof(uint32_t));
+    size_t start = r.head - len - REWIND_FRAME_OVERHEAD;
+    delta_apply(r.ring + start + sizeof(uint32_t), (unsigned char *)&r.last);
+    // its space is reused straight away
+    r.head = start;
+    r.frames = r.frames - 1;
+    r.used = r.used - len - REWIND_FRAME_OVERHEAD;
+    reset_if_empty(r);
+    // keep the keys the player is holding now
+    memcpy(r.last.KEYS, m.KEYS, sizeof(r.last.KEYS));
+    snapshot_restore(m, r.last);
+    return 0;
+}
+
+unsigned long rewind_frames(const rewind_buffer &r)
+{
+    return r.frames;
+}
+
+void rewind_report(const rewind_buffer &r)
+{
+    double avg = r.pushed > 0 ? (double)r.pushed_bytes / r.pushed : 0.0;
+    // a minute of history at the 60Hz frame rate, against storing full snapshots
+    double minute = avg * 60 * 60;
+    double full = (double)REWIND_SNAP_SIZE * 60 * 60;
+    printf("rewind: %lu frames held (%.1f s) in %lu of %lu bytes, %lu frames dropped\n",
+        rewind_frames(r), rewind_frames(r) / 60.0, (unsigned long)r.used, (unsigned long)r.capacity, r.dropped);
+    printf("rewind: %.1f bytes/frame average = %.1f KB per minute (full snapshots: %.1f KB per minute)\n",
+        avg, minute / 1024, full / 1024);
+}
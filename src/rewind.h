@@ -0,0 +1,65 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+// rewind history: one machine state per frame, kept in a fixed-size byte ring
+// each frame is stored as the XOR of its snapshot against the next frame's,
+// run-length encoded, so a frame where only a few bytes of RAM and the display
+// changed costs a few dozen bytes instead of a full chip8_snapshot
+// frame lengths are stored in the ring next to the deltas, so the ring is all
+// the memory the history uses
+#include <stdint.h>
+#include "savestate.h"
+
+// default history size in MB (--rewind)
+#define REWIND_DEFAULT_MB 8
+
+// bytes a frame takes in the ring on top of its delta: the delta's length
+// before it (to drop the oldest) and after it (to step back from the newest)
+#define REWIND_FRAME_OVERHEAD (2 * sizeof(uint32_t))
+
+struct rewind_buffer
+{
+    // encoded deltas, capacity bytes
+    unsigned char *ring;
+    size_t capacity;
+    // where the next frame is written, and where the oldest one starts
+    size_t head;
+    size_t tail;
+    // once head has gone back round to 0, the end of the frames still held past
+    // it (SIZE_MAX while the frames run straight from tail to head)
+    size_t wrap;
+    // frames held, and the ring bytes they take (lengths included)
+    unsigned long frames;
+    size_t used;
+    // the newest frame in full - stepping back XORs deltas into it
+    chip8_snapshot last;
+    bool have_last;
+    // encode/decode scratch space (worst case is bigger than a snapshot)
+    unsigned char *scratch;
+    // totals for rewind_report
+    unsigned long pushed;
+    unsigned long pushed_bytes;
+    unsigned long dropped;
+};
+
+// allocate a history of at most capacity bytes, returns non-zero on failure
+int rewind_init(rewind_buffer &r, size_t capacity);
+
+// free the history
+void rewind_close(rewind_buffer &r);
+
+// record the machine's current state as the newest frame
+// the oldest frames are dropped to stay inside the memory cap
+void rewind_push(rewind_buffer &r, const Chip8Machine &m);
+
+// put the machine back one frame (the keypad is left alone, it is live input)
+// returns non-zero if there is no older frame
+int rewind_step(rewind_buffer &r, Chip8Machine &m);
+
+// number of frames the machine can currently step back
+unsigned long rewind_frames(const rewind_buffer &r);
+
+// print frames held, bytes used and the average cost of a minute of history at 60Hz
+void rewind_report(const rewind_buffer &r);
+
+#endif
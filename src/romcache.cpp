@@ -0,0 +1,125 @@
+// ROM loader and image cache (see romcache.h)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "romcache.h"
+
+// a path we have loaded, and the file identity it had then
+// (a file that changes on disk is read again)
+struct rom_path_entry
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    const rom_image *image;
+};
+
+// images by content hash, so copies of a ROM under different names share one
+static std::unordered_map<uint64_t, rom_image *> ROM_IMAGES;
+// path -> image, so repeat loads of a path only need a stat()
+static std::unordered_map<std::string, rom_path_entry> ROM_PATHS;
+static std::mutex ROM_LOCK;
+
+static bool same_file(const rom_path_entry &e, const struct stat &st)
+{
+    return e.dev == st.st_dev && e.ino == st.st_ino && e.size == st.st_size &&
+        e.mtime.tv_sec == st.st_mtim.tv_sec && e.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// map the file and check it is something we can run
+// returns the mapping (size bytes) or NULL
+static const unsigned char *map_rom(const char *filename, int fd, const struct stat &st)
+{
+    if (!S_ISREG(st.st_mode))
+    {
+        printf("ERROR: ROM %s is not a regular file\n", filename);
+        return NULL;
+    }
+    if (st.st_size == 0)
+    {
+        printf("ERROR: ROM %s is empty\n", filename);
+        return NULL;
+    }
+    if (st.st_size > ROM_MAX_SIZE)
+    {
+        printf("ERROR: ROM %s is %ld bytes, the most that fits in memory is %d\n", filename, (long)st.st_size,
+            ROM_MAX_SIZE);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        printf("ERROR: could not map ROM %s\n", filename);
+        return NULL;
+    }
+    return (const unsigned char *)data;
+}
+
+const rom_image *rom_load(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("ERROR: could not open ROM %s\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        printf("ERROR: could not stat ROM %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(ROM_LOCK);
+    std::unordered_map<std::string, rom_path_entry>::iterator path = ROM_PATHS.find(filename);
+    if (path != ROM_PATHS.end() && same_file(path->second, st))
+    {
+        close(fd);
+        return path->second.image;
+    }
+
+    const unsigned char *data = map_rom(filename, fd, st);
+    close(fd);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    uint64_t hash = 14695981039346656037UL;
+    for (off_t i = 0; i < st.st_size; i++)
+    {
+        hash = (hash ^ data[i]) * 1099511628211UL;
+    }
+    if (st.st_size % 2 != 0)
+    {
+        printf("WARNING: ROM %s has an odd size (%ld bytes), the last byte is not a whole instruction\n", filename,
+            (long)st.st_size);
+    }
+
+    rom_image *image;
+    std::unordered_map<uint64_t, rom_image *>::iterator found = ROM_IMAGES.find(hash);
+    if (found != ROM_IMAGES.end() && found->second->size == st.st_size &&
+        memcmp(found->second->ram + ROM_START, data, st.st_size) == 0)
+    {
+        image = found->second;
+    }
+    else
+    {
+        image = new rom_image();
+        image->hash = hash;
+        image->size = st.st_size;
+        memset(image->ram, 0, sizeof(image->ram));
+        memcpy(image->ram + FONT_START, FONTS.data(), FONTS.size());
+        memcpy(image->ram + BIG_FONT_START, BIG_FONTS.data(), BIG_FONTS.size());
+        memcpy(image->ram + ROM_START, data, st.st_size);
+        ROM_IMAGES[hash] = image;
+    }
+    munmap((void *)data, st.st_size);
+    ROM_PATHS[filename] = {st.st_dev, st.st_ino, st.st_size, st.st_mtim, image};
+    return image;
+}
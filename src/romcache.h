@@ -0,0 +1,31 @@
+#ifndef ROMCACHE_H
+#define ROMCACHE_H
+
+// ROM loader and in-process ROM image cache
+// a ROM file is mapped, checked and hashed once; the result is a ready-made
+// initial RAM image (fonts + program) that init_CPU copies in with one memcpy,
+// so starting many machines on the same ROM costs no I/O after the first
+#include <stdint.h>
+#include "cpu.h"
+
+// programs are loaded at 0x200 and can fill the rest of RAM
+#define ROM_START 512
+#define ROM_MAX_SIZE (RAM_SIZE - ROM_START)
+
+struct rom_image
+{
+    // FNV-1a hash of the ROM file's contents
+    uint64_t hash;
+    // program size in bytes
+    unsigned int size;
+    // initial RAM: fonts at 0x050 and 0x0A0, the program at ROM_START, zeros elsewhere
+    unsigned char ram[RAM_SIZE];
+};
+
+// load a ROM file, or find it in the cache
+// returns NULL (after printing why) if the file can't be read or is not a valid ROM
+// images are shared and live until the process exits - never modify or free one
+// safe to call from several threads
+const rom_image *rom_load(const char *filename);
+
+#endif
@@ -0,0 +1,130 @@
+// machine snapshots and save state files (see savestate.h)
+#include "savestate.h"
+
+// RAM is compared in chunks of this many bytes on restore
+#define SNAPSHOT_CHUNK 64
+
+// every byte of the struct is a named field
+static_assert(sizeof(chip8_snapshot) == 40 + 40 + RPL_FLAGS + 8 * DISPLAY_WORDS * DISPLAY_HIRES_HEIGHT +
+    2 * STACK_SIZE + RAM_SIZE,
+    "chip8_snapshot has padding");
+
+void snapshot_take(const Chip8Machine &m, chip8_snapshot &snap)
+{
+    snap.magic = SNAPSHOT_MAGIC;
+    snap.version = SNAPSHOT_VERSION;
+    snap.size = sizeof(chip8_snapshot);
+    snap.reserved = 0;
+    snap.PC = m.PC;
+    snap.IND = m.IND;
+    snap.SP = m.SP;
+    snap.OPCODE = m.OPCODE;
+    snap.cycles = m.cycles;
+    snap.rng = m.rng;
+    snap.DEL_TIME = CPU_get_delay(m);
+    snap.SOUND_TIME = CPU_get_sound(m);
+    memcpy(snap.VAR, m.VAR, sizeof(snap.VAR));
+    memcpy(snap.KEYS, m.KEYS, sizeof(snap.KEYS));
+    snap.hires = (uint8_t)m.display.hires;
+    memset(snap.pad, 0, sizeof(snap.pad));
+    memcpy(snap.RPL, m.RPL, sizeof(snap.RPL));
+    memcpy(snap.STACK, m.STACK, sizeof(snap.STACK));
+    memcpy(snap.RAM, m.RAM, sizeof(snap.RAM));
+    memcpy(snap.display, m.display.rows, sizeof(snap.display));
+}
+
+void snapshot_restore(Chip8Machine &m, const chip8_snapshot &snap)
+{
+    // drop decoded instructions only where the RAM differs
+    for (unsigned int i = 0; i < RAM_SIZE; i = i + SNAPSHOT_CHUNK)
+    {
+        if (memcmp(m.RAM + i, snap.RAM + i, SNAPSHOT_CHUNK) != 0)
+        {
+            memcpy(m.RAM + i, snap.RAM + i, SNAPSHOT_CHUNK);
+            invalidate_decode(m, i, SNAPSHOT_CHUNK);
+        }
+    }
+    m.PC = snap.PC;
+    m.IND = snap.IND;
+    m.SP = snap.SP;
+    m.OPCODE = snap.OPCODE;
+    m.cycles = snap.cycles;
+    m.rng = snap.rng;
+    memcpy(m.VAR, snap.VAR, sizeof(m.VAR));
+    memcpy(m.KEYS, snap.KEYS, sizeof(m.KEYS));
+    memcpy(m.STACK, snap.STACK, sizeof(m.STACK));
+    memcpy(m.display.rows, snap.display, sizeof(m.display.rows));
+    m.display.hires = snap.hires;
+    memcpy(m.RPL, snap.RPL, sizeof(m.RPL));
+    // latch the timers on this machine's clock (after cycles, for the virtual clock)
+    CPU_set_delay(m, snap.DEL_TIME);
+    CPU_set_sound(m, snap.SOUND_TIME);
+}
+
+int snapshot_check(const chip8_snapshot &snap)
+{
+    if (snap.magic != SNAPSHOT_MAGIC)
+    {
+        printf("%s","ERROR: not a chip8 save state\n");
+        return 1;
+    }
+    if (snap.version != SNAPSHOT_VERSION || snap.size != sizeof(chip8_snapshot))
+    {
+        printf("ERROR: save state version %u (%u bytes) does not match this build (version %u, %u bytes)\n",
+            snap.version, snap.size, SNAPSHOT_VERSION, (unsigned int)sizeof(chip8_snapshot));
+        return 1;
+    }
+    return 0;
+}
+
+int snapshot_save(const Chip8Machine &m, const char *filename)
+{
+    chip8_snapshot snap;
+    snapshot_take(m, snap);
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        printf("ERROR: could not open save state %s\n", filename);
+        return 1;
+    }
+    if (fwrite(&snap, sizeof(snap), 1, file) != 1)
+    {
+        printf("ERROR: could not write save state %s\n", filename);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+    printf("Saved state to %s (cycle %lu)\n", filename, m.cycles);
+    return 0;
+}
+
+int snapshot_load(Chip8Machine &m, const char *filename)
+{
+    chip8_snapshot snap;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        printf("ERROR: could not open save state %s\n", filename);
+        return 1;
+    }
+    // read the header first so an old or foreign file gets a useful error
+    size_t got = fread(&snap, 1, sizeof(snap), file);
+    fclose(file);
+    if (got < 3 * sizeof(uint32_t))
+    {
+        printf("%s","ERROR: not a chip8 save state\n");
+        return 1;
+    }
+    if (snapshot_check(snap) != 0)
+    {
+        return 1;
+    }
+    if (got != sizeof(snap))
+    {
+        printf("ERROR: save state %s is truncated\n", filename);
+        return 1;
+    }
+    snapshot_restore(m, snap);
+    printf("Loaded state from %s (cycle %lu)\n", filename, m.cycles);
+    return 0;
+}
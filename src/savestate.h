@@ -0,0 +1,66 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+// machine snapshots: capture and restore a running machine
+// a snapshot is one fixed-size struct, so taking or restoring one is a handful
+// of memcpys; the same bytes are what gets written to a save state file
+#include "cpu.h"
+
+// "C8ST" file magic
+#define SNAPSHOT_MAGIC 0x54533843
+// bump whenever chip8_snapshot changes layout
+#define SNAPSHOT_VERSION 3
+
+// snapshot of everything a program can observe
+// stored in host byte order (little-endian on x86); fields are laid out so the
+// struct has no hidden padding
+struct chip8_snapshot
+{
+    // header
+    uint32_t magic;
+    uint32_t version;
+    // size of the whole struct, as a sanity check on load
+    uint32_t size;
+    uint32_t reserved;
+    // instructions executed (the virtual timer clock runs on this)
+    uint64_t cycles;
+    // random number generator state (version 2)
+    uint64_t rng;
+    // registers
+    uint16_t PC;
+    uint16_t IND;
+    uint16_t SP;
+    uint16_t OPCODE;
+    // current timer values (re-latched on the restoring machine's clock)
+    uint8_t DEL_TIME;
+    uint8_t SOUND_TIME;
+    uint8_t VAR[16];
+    uint8_t KEYS[16];
+    // display mode (version 3)
+    uint8_t hires;
+    uint8_t pad[5];
+    // SUPER-CHIP RPL flags (version 3)
+    uint8_t RPL[RPL_FLAGS];
+    uint64_t display[DISPLAY_HIRES_HEIGHT][DISPLAY_WORDS];
+    uint16_t STACK[STACK_SIZE];
+    uint8_t RAM[RAM_SIZE];
+};
+
+// copy a machine's state into a snapshot
+void snapshot_take(const Chip8Machine &m, chip8_snapshot &snap);
+
+// put a machine back into a snapshot's state
+// only decode cache (and recompiler) entries over RAM that changed are dropped,
+// so restoring a nearby snapshot is cheap
+void snapshot_restore(Chip8Machine &m, const chip8_snapshot &snap);
+
+// check a snapshot's header, returns non-zero (and prints why) if it can't be restored
+int snapshot_check(const chip8_snapshot &snap);
+
+// write a machine's state to a save state file
+int snapshot_save(const Chip8Machine &m, const char *filename);
+
+// restore a machine from a save state file
+int snapshot_load(Chip8Machine &m, const char *filename);
+
+#endif
@@ -0,0 +1,358 @@
+// software scaling stage (see scaler.h)
+#include <stdio.h>
+#include <string.h>
+#include "scaler.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCALER_X86 1
+#endif
+
+// on pixel = white, off pixel = black
+#define SCALER_ON 0xFFFFFFFF
+#define SCALER_OFF 0xFF000000
+
+// ARGB colour at half brightness (scanlines)
+static uint32_t dim_colour(uint32_t c)
+{
+    return ((c >> 1) & 0x007F7F7F) | (c & 0xFF000000);
+}
+
+// plain C kernel: no overrun, works everywhere
+static void expand_scalar(const uint64_t *bits, int words, int factor, uint32_t on, uint32_t off, uint32_t *out)
+{
+    for (int i = 0; i < words; i++)
+    {
+        uint64_t w = bits[i];
+        for (int b = 0; b < 64; b++)
+        {
+            uint32_t c = (w >> 63) ? on : off;
+            w = w << 1;
+            for (int k = 0; k < factor; k++)
+            {
+                *out++ = c;
+            }
+        }
+    }
+}
+
+#ifdef SCALER_X86
+// SSE2 kernel: 4 pixels per store
+// factor 1 turns each nibble into a 4-pixel select mask; larger factors
+// broadcast the pixel's colour and store it factor / 4 times (rounded up),
+// letting the last store run into the next pixel, which then overwrites it
+__attribute__((target("sse2")))
+static void expand_sse2(const uint64_t *bits, int words, int factor, uint32_t on, uint32_t off, uint32_t *out)
+{
+    const __m128i von = _mm_set1_epi32((int)on);
+    const __m128i voff = _mm_set1_epi32((int)off);
+    if (factor == 1)
+    {
+        // pixel 0 is the nibble's top bit
+        const __m128i sel = _mm_set_epi32(1, 2, 4, 8);
+        for (int i = 0; i < words; i++)
+        {
+            uint64_t w = bits[i];
+            for (int n = 0; n < 16; n++)
+            {
+                __m128i v = _mm_set1_epi32((int)(w >> 60));
+                __m128i m = _mm_cmpeq_epi32(_mm_and_si128(v, sel), sel);
+                _mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_and_si128(m, von), _mm_andnot_si128(m, voff)));
+                w = w << 4;
+                out = out + 4;
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < words; i++)
+    {
+        uint64_t w = bits[i];
+        for (int b = 0; b < 64; b++)
+        {
+            __m128i c = (w >> 63) ? von : voff;
+            w = w << 1;
+            for (int k = 0; k < factor; k = k + 4)
+            {
+                _mm_storeu_si128((__m128i *)(out + k), c);
+            }
+            out = out + factor;
+        }
+    }
+}
+
+// AVX2 kernel: 8 pixels per store, same scheme as SSE2 (factor 1 works a byte at a time)
+__attribute__((target("avx2")))
+static void expand_avx2(const uint64_t *bits, int words, int factor, uint32_t on, uint32_t off, uint32_t *out)
+{
+    const __m256i von = _mm256_set1_epi32((int)on);
+    const __m256i voff = _mm256_set1_epi32((int)off);
+    if (factor == 1)
+    {
+        const __m256i sel = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        for (int i = 0; i < words; i++)
+        {
+            uint64_t w = bits[i];
+            for (int n = 0; n < 8; n++)
+            {
+                __m256i v = _mm256_set1_epi32((int)(w >> 56));
+                __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(v, sel), sel);
+                _mm256_storeu_si256((__m256i *)out, _mm256_blendv_epi8(voff, von, m));
+                w = w << 8;
+                out = out + 8;
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < words; i++)
+    {
+        uint64_t w = bits[i];
+        for (int b = 0; b < 64; b++)
+        {
+            __m256i c = (w >> 63) ? von : voff;
+            w = w << 1;
+            for (int k = 0; k < factor; k = k + 8)
+            {
+                _mm256_storeu_si256((__m256i *)(out + k), c);
+            }
+            out = out + factor;
+        }
+    }
+}
+#endif
+
+int scaler_set_kernel(scaler &s, const char *name)
+{
+    if (strcmp(name, "scalar") == 0)
+    {
+        s.kernel = expand_scalar;
+        s.kernel_name = "scalar";
+        return 0;
+    }
+#ifdef SCALER_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+    {
+        s.kernel = expand_sse2;
+        s.kernel_name = "sse2";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        s.kernel = expand_avx2;
+        s.kernel_name = "avx2";
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+int scaler_factor(int filter)
+{
+    return filter == FILTER_SCALE3X ? 3 : (filter == FILTER_SCALE2X ? 2 : 1);
+}
+
+int scaler_init(scaler &s, int scale, int filter, bool scanlines)
+{
+    s.factor = scaler_factor(filter);
+    if (scale < 1 || scale % s.factor != 0)
+    {
+        printf("ERROR: Scale%dx needs a pixel size that is a multiple of %d (got %d)\n", s.factor, s.factor, scale);
+        return 1;
+    }
+    s.scale = scale;
+    s.filter = filter;
+    s.expand = scale / s.factor;
+    s.scanlines = scanlines;
+    s.on = SCALER_ON;
+    s.off = SCALER_OFF;
+    s.on_dim = dim_colour(SCALER_ON);
+    s.off_dim = dim_colour(SCALER_OFF);
+    // best kernel first
+    if (scaler_set_kernel(s, "avx2") != 0 && scaler_set_kernel(s, "sse2") != 0)
+    {
+        scaler_set_kernel(s, "scalar");
+    }
+    return 0;
+}
+
+uint64_t scaler_dirty(const scaler &s, uint64_t dirty_rows)
+{
+    if (s.factor == 1)
+    {
+        return dirty_rows;
+    }
+    return dirty_rows | (dirty_rows << 1) | (dirty_rows >> 1);
+}
+
+// neighbours of each pixel in a row of words (MSB = leftmost); edges repeat the edge pixel
+static inline uint64_t left_of(const uint64_t *row, int i)
+{
+    return (row[i] >> 1) | (i > 0 ? row[i - 1] << 63 : row[0] & (1ULL << 63));
+}
+
+static inline uint64_t right_of(const uint64_t *row, int i, int words)
+{
+    return (row[i] << 1) | (i < words - 1 ? row[i + 1] >> 63 : row[i] & 1);
+}
+
+// per-pixel select: m ? a : b
+static inline uint64_t sel(uint64_t m, uint64_t a, uint64_t b)
+{
+    return (m & a) | (~m & b);
+}
+
+// spread the 32 bits of v to the even bit positions of a word
+static inline uint64_t spread2(uint32_t v)
+{
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+// bit i of a byte moved to bit 3 * i (for tripling rows)
+static uint32_t SPREAD3[256];
+
+static void spread3_init()
+{
+    if (SPREAD3[255] != 0)
+    {
+        return;
+    }
+    for (int v = 0; v < 256; v++)
+    {
+        uint32_t x = 0;
+        for (int b = 0; b < 8; b++)
+        {
+            x = x | (uint32_t)((v >> b) & 1) << (3 * b);
+        }
+        SPREAD3[v] = x;
+    }
+}
+
+// interleave the pixels of a and b (a first) into 2 words
+static inline void interleave2(uint64_t a, uint64_t b, uint64_t *out)
+{
+    out[0] = (spread2((uint32_t)(a >> 32)) << 1) | spread2((uint32_t)(b >> 32));
+    out[1] = (spread2((uint32_t)a) << 1) | spread2((uint32_t)b);
+}
+
+// interleave the pixels of a, b and c (a first) into 3 words
+static inline void interleave3(uint64_t a, uint64_t b, uint64_t c, uint64_t *out)
+{
+    // 8 source pixels become 24 output bits, built a byte of each input at a time
+    unsigned char bytes[24];
+    for (int k = 0; k < 8; k++)
+    {
+        int shift = 56 - 8 * k;
+        uint32_t bits = (SPREAD3[(a >> shift) & 0xFF] << 2) | (SPREAD3[(b >> shift) & 0xFF] << 1) |
+            SPREAD3[(c >> shift) & 0xFF];
+        bytes[3 * k] = (unsigned char)(bits >> 16);
+        bytes[3 * k + 1] = (unsigned char)(bits >> 8);
+        bytes[3 * k + 2] = (unsigned char)bits;
+    }
+    for (int j = 0; j < 3; j++)
+    {
+        uint64_t w = 0;
+        for (int k = 0; k < 8; k++)
+        {
+            w = (w << 8) | bytes[8 * j + k];
+        }
+        out[j] = w;
+    }
+}
+
+// Scale2x/Scale3x on a 1-bit image, a whole word of pixels at a time
+// with B above, D left, F right and H below the centre pixel E, each corner of the
+// output copies a neighbour when the two neighbours next to it match and the
+// other two don't (two-colour images make "==" a XNOR)
+static void filter_row(scaler &s, const uint64_t *plane, int stride, int words, int height, int y, uint64_t *out)
+{
+    const uint64_t *row_e = plane + y * stride;
+    const uint64_t *row_b = y > 0 ? row_e - stride : row_e;
+    const uint64_t *row_h = y < height - 1 ? row_e + stride : row_e;
+    int out_words = words * s.factor;
+    for (int i = 0; i < words; i++)
+    {
+        uint64_t e = row_e[i];
+        uint64_t b = row_b[i];
+        uint64_t h = row_h[i];
+        uint64_t d = left_of(row_e, i);
+        uint64_t f = right_of(row_e, i, words);
+        // corner conditions: top-left, top-right, bottom-left, bottom-right
+        uint64_t p = ~(d ^ b) & (b ^ f) & (d ^ h);
+        uint64_t q = ~(b ^ f) & (b ^ d) & (f ^ h);
+        uint64_t r = ~(d ^ h) & (d ^ b) & (h ^ f);
+        uint64_t t = ~(h ^ f) & (d ^ h) & (b ^ f);
+        if (s.factor == 2)
+        {
+            interleave2(sel(p, d, e), sel(q, f, e), out + 2 * i);
+            interleave2(sel(r, d, e), sel(t, f, e), out + out_words + 2 * i);
+            continue;
+        }
+        // Scale3x edge centres also look at the diagonals
+        uint64_t a = left_of(row_b, i);
+        uint64_t c = right_of(row_b, i, words);
+        uint64_t g = left_of(row_h, i);
+        uint64_t k = right_of(row_h, i, words);
+        uint64_t e1 = sel((p & (e ^ c)) | (q & (e ^ a)), b, e);
+        uint64_t e3 = sel((p & (e ^ g)) | (r & (e ^ a)), d, e);
+        uint64_t e5 = sel((q & (e ^ k)) | (t & (e ^ c)), f, e);
+        uint64_t e7 = sel((r & (e ^ k)) | (t & (e ^ g)), h, e);
+        interleave3(sel(p, d, e), e1, sel(q, f, e), out + 3 * i);
+        interleave3(e3, e, e5, out + out_words + 3 * i);
+        interleave3(sel(r, d, e), e7, sel(t, f, e), out + 2 * out_words + 3 * i);
+    }
+}
+
+void scaler_draw(scaler &s, const uint64_t *plane, int stride, int width, int height, int first, int count,
+    uint32_t *out, int pitch)
+{
+    int words = width / 64;
+    int row_words = words * s.factor;
+    size_t out_width = (size_t)width * s.scale;
+    if (s.line.size() < out_width + SCALER_PAD)
+    {
+        s.line.resize(out_width + SCALER_PAD);
+        s.dim_line.resize(out_width + SCALER_PAD);
+    }
+    if (s.factor > 1)
+    {
+        s.filtered.resize(row_words * s.factor);
+        spread3_init();
+    }
+    // scanlines: the bottom quarter (at least one line) of each display row at half brightness
+    int dim = 0;
+    if (s.scanlines && s.scale >= 2)
+    {
+        dim = s.scale / 4 > 0 ? s.scale / 4 : 1;
+    }
+    for (int y = first; y < first + count; y++)
+    {
+        const uint64_t *rows = plane + y * stride;
+        if (s.factor > 1)
+        {
+            filter_row(s, plane, stride, words, height, y, s.filtered.data());
+            rows = s.filtered.data();
+        }
+        uint32_t *dst = out + (size_t)(y - first) * s.scale * pitch;
+        for (int sub = 0; sub < s.factor; sub++)
+        {
+            // expand the row once, then copy it to each output line it covers
+            const uint64_t *bits = rows + sub * row_words;
+            s.kernel(bits, row_words, s.expand, s.on, s.off, s.line.data());
+            int top = sub * s.expand;
+            if (top + s.expand > s.scale - dim)
+            {
+                s.kernel(bits, row_words, s.expand, s.on_dim, s.off_dim, s.dim_line.data());
+            }
+            for (int k = 0; k < s.expand; k++)
+            {
+                const uint32_t *src = (top + k >= s.scale - dim) ? s.dim_line.data() : s.line.data();
+                memcpy(dst + (size_t)(top + k) * pitch, src, out_width * sizeof(uint32_t));
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+// software scaling stage: turns the packed 1-bit display into ARGB pixels
+// at an integer scale, with optional pixel-art filters and scanlines
+// the row expansion runs on SSE2 or AVX2 kernels picked at runtime from the
+// CPU's features (plain C elsewhere); this header does not pull in SDL
+#include <stdint.h>
+#include <vector>
+
+// filters, applied to the bitplane before the integer scale
+#define FILTER_NONE 0
+// Scale2x/Scale3x (AdvMAME): smooth diagonal edges by 2x/3x, -x must be a multiple of 2/3
+#define FILTER_SCALE2X 1
+#define FILTER_SCALE3X 2
+
+// row expansion kernel: writes factor copies of each pixel of a bitplane row
+// (words 64-bit words, MSB = leftmost) to out, in the on/off colours
+// may write up to SCALER_PAD pixels past the end of the row
+typedef void (*scaler_kernel)(const uint64_t *bits, int words, int factor, uint32_t on, uint32_t off, uint32_t *out);
+
+// pixels a kernel may write past the end of a row
+#define SCALER_PAD 8
+
+struct scaler
+{
+    // output pixels per display pixel
+    int scale;
+    int filter;
+    // filter factor (1, 2 or 3) and the integer factor applied after it
+    int factor;
+    int expand;
+    // darken the bottom lines of each display row
+    bool scanlines;
+    // ARGB colours, and their scanline versions
+    uint32_t on;
+    uint32_t off;
+    uint32_t on_dim;
+    uint32_t off_dim;
+    // row expansion kernel and its name ("avx2", "sse2" or "scalar")
+    scaler_kernel kernel;
+    const char *kernel_name;
+    // scratch: filtered rows of one display row, and one expanded output line
+    std::vector<uint64_t> filtered;
+    std::vector<uint32_t> line;
+    std::vector<uint32_t> dim_line;
+};
+
+// scale factor of a filter (1, 2 or 3) - the output scale must be a multiple of it
+int scaler_factor(int filter);
+
+// set up a scaler, using the fastest kernel the CPU supports
+// returns non-zero (and prints why) if scale does not suit the filter
+int scaler_init(scaler &s, int scale, int filter, bool scanlines);
+
+// use a named kernel ("avx2", "sse2" or "scalar") instead of the detected one
+// returns non-zero if this CPU or build doesn't have it
+int scaler_set_kernel(scaler &s, const char *name);
+
+// widen a dirty row mask to cover the rows the filter reads (a row's neighbours
+// change how its edges are smoothed)
+uint64_t scaler_dirty(const scaler &s, uint64_t dirty_rows);
+
+// render display rows [first, first + count) of a width x height bitplane
+// (rows of width / 64 words, stride words apart) into ARGB at out, which points
+// at output row first * scale and has pitch pixels per line
+// every output pixel of those rows is written
+void scaler_draw(scaler &s, const uint64_t *plane, int stride, int width, int height, int first, int count,
+    uint32_t *out, int pitch);
+
+#endif
@@ -0,0 +1,123 @@
+// frame scheduler: one instruction burst and one sleep per 60Hz frame
+#include <stdio.h>
+#include "scheduler.h"
+
+// add ns nanoseconds (may be negative) to a timespec
+static void ts_add(struct timespec &t, long ns)
+{
+    t.tv_nsec = t.tv_nsec + ns;
+    while (t.tv_nsec >= 1000000000L)
+    {
+        t.tv_nsec = t.tv_nsec - 1000000000L;
+        t.tv_sec = t.tv_sec + 1;
+    }
+    while (t.tv_nsec < 0)
+    {
+        t.tv_nsec = t.tv_nsec + 1000000000L;
+        t.tv_sec = t.tv_sec - 1;
+    }
+}
+
+// nanoseconds from a to b (negative if b is before a)
+static long ts_diff(const struct timespec &a, const struct timespec &b)
+{
+    return (b.tv_sec - a.tv_sec) * 1000000000L + (b.tv_nsec - a.tv_nsec);
+}
+
+void sched_init(frame_scheduler &s, unsigned long ips, bool spin)
+{
+    s.ips = ips;
+    s.remainder = 0;
+    s.spin = spin;
+    s.frames = 0;
+    s.late = 0;
+    clock_gettime(CLOCK_MONOTONIC, &s.start);
+    s.deadline = s.start;
+    ts_add(s.deadline, 1000000000L / SCHED_HZ);
+}
+
+unsigned long sched_frame_budget(frame_scheduler &s)
+{
+    // spread ips over SCHED_HZ frames, carrying the remainder forward
+    s.remainder = s.remainder + s.ips;
+    unsigned long budget = s.remainder / SCHED_HZ;
+    s.remainder = s.remainder % SCHED_HZ;
+    return budget;
+}
+
+void sched_wait(frame_scheduler &s)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s.frames = s.frames + 1;
+    if (ts_diff(now, s.deadline) < 0)
+    {
+        // the burst overran its frame - start the next frame from now instead of
+        // running a string of back to back bursts to catch up
+        s.late = s.late + 1;
+        s.deadline = now;
+        ts_add(s.deadline, 1000000000L / SCHED_HZ);
+        return;
+    }
+    if (s.spin)
+    {
+        // sleep until shortly before the deadline, then spin the rest of the way
+        // (trades some CPU for less wakeup jitter)
+        struct timespec wake = s.deadline;
+        ts_add(wake, -SCHED_SPIN_NS);
+        if (ts_diff(now, wake) > 0)
+        {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+        }
+        do
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while (ts_diff(now, s.deadline) > 0);
+    }
+    else
+    {
+        // absolute deadline, so sleeps that run long don't add up frame to frame
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &s.deadline, NULL) != 0)
+        {
+            // interrupted by a signal - go back to sleep
+        }
+    }
+    ts_add(s.deadline, 1000000000L / SCHED_HZ);
+}
+
+unsigned long sched_passed(frame_scheduler &s)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long late = ts_diff(s.deadline, now);
+    if (late < 0)
+    {
+        return 0;
+    }
+    // the deadline itself plus every whole frame after it
+    unsigned long passed = late / (1000000000L / SCHED_HZ) + 1;
+    s.frames = s.frames + passed;
+    ts_add(s.deadline, (long)passed * (1000000000L / SCHED_HZ));
+    return passed;
+}
+
+long sched_time_left(const frame_scheduler &s)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff(now, s.deadline);
+}
+
+double sched_elapsed(const frame_scheduler &s)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff(s.start, now) / 1e9;
+}
+
+void sched_report(const frame_scheduler &s, unsigned long cycles)
+{
+    double secs = sched_elapsed(s);
+    printf("scheduler: %lu instructions in %.3f s = %.0f instructions/s (target %lu), %lu frames, %lu late\n",
+        cycles, secs, secs > 0 ? cycles / secs : 0.0, s.ips, s.frames, s.late);
+}
@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// frame scheduler for the CPU thread
+// the CPU runs a frame's worth of instructions in one burst, then sleeps once
+// until the next 60Hz frame deadline on the absolute monotonic clock, so the
+// instruction rate does not depend on per-sleep timer slack
+#include <time.h>
+
+// frames per second the scheduler paces on (the chip8 timer rate)
+#define SCHED_HZ 60
+
+// how long before a deadline the hybrid mode stops sleeping and spins (ns)
+#define SCHED_SPIN_NS 1000000L
+
+struct frame_scheduler
+{
+    // target instructions per second
+    unsigned long ips;
+    // leftover ips/SCHED_HZ remainder, so rates that don't divide evenly still average out
+    unsigned long remainder;
+    // absolute deadline of the current frame
+    struct timespec deadline;
+    // true = sleep until SCHED_SPIN_NS before the deadline, then spin
+    bool spin;
+    // start of the run and frames scheduled since, for reporting
+    struct timespec start;
+    unsigned long frames;
+    // frames that finished after their deadline (the schedule is resynced rather than caught up)
+    unsigned long late;
+};
+
+// set up a scheduler for the given rate, starting the first frame now
+void sched_init(frame_scheduler &s, unsigned long ips, bool spin);
+
+// number of instructions to run in the current frame
+unsigned long sched_frame_budget(frame_scheduler &s);
+
+// wait for the current frame's deadline and start the next frame
+void sched_wait(frame_scheduler &s);
+
+// for a caller that slept through frames instead of calling sched_wait:
+// returns how many frame deadlines have passed (0 = still in the current frame)
+// and counts those frames, so the next one starts at the next deadline ahead
+unsigned long sched_passed(frame_scheduler &s);
+
+// nanoseconds left until the current frame's deadline (negative once it has passed)
+long sched_time_left(const frame_scheduler &s);
+
+// seconds since sched_init
+double sched_elapsed(const frame_scheduler &s);
+
+// print the achieved rate for a run that executed the given number of instructions
+void sched_report(const frame_scheduler &s, unsigned long cycles);
+
+#endif